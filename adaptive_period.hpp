@@ -0,0 +1,113 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _ADAPTIVE_PERIOD_H_
+#define _ADAPTIVE_PERIOD_H_
+
+#include <algorithm>
+#include <stdint.h>
+
+#include "common.hpp"
+#include "config.hpp"
+
+/*
+ * Watches one take and proposes the period size for the next one, see AdaptiveConfig.
+ * The smallest period that overran (xrun or sink above max_sink_load) is remembered
+ * across takes and the period never shrinks to it again, so it does not oscillate
+ * between a size that works and one that loses audio.
+ */
+class AdaptivePeriod{
+public:
+    AdaptivePeriod(){
+        TR_MSG("AdaptivePeriod");
+    };
+
+    void init(const AdaptiveConfig& config, unsigned int rate){
+        m_config = config;
+        m_rate = rate;
+        m_overrunPeriod = 0;
+    };
+
+    void startTake(int periodFrames, int periodTimeUs){
+        m_periodFrames = periodFrames;
+        m_periodTimeNs = (uint64_t)periodTimeUs * 1000;
+        m_periods = 0;
+        m_xruns = 0;
+        m_maxSinkNs = 0;
+        m_sumSinkNs = 0;
+    };
+
+    // capture thread, after the period was handed to the sinks
+    void onPeriod(uint64_t sinkNs, bool xrun){
+        m_periods++;
+        m_xruns += xrun ? 1 : 0;
+        m_maxSinkNs = std::max(m_maxSinkNs, sinkNs);
+        m_sumSinkNs += sinkNs;
+    };
+
+    // period size for the next take, only valid after the take has finished
+    int nextPeriodSize(){
+        if(m_periodFrames <= 0 || m_periods < MIN_PERIODS || m_periodTimeNs == 0){
+            // too short to say anything
+            return m_periodFrames;
+        }
+        double load = (double)m_maxSinkNs / m_periodTimeNs;
+        int next = m_periodFrames;
+        if(m_xruns > 0 || load > m_config.max_sink_load){
+            next = m_periodFrames * 2;
+            if(m_overrunPeriod == 0 || m_periodFrames < m_overrunPeriod){
+                m_overrunPeriod = m_periodFrames;
+            }
+        } else {
+            uint64_t targetFrames = (uint64_t)m_config.target_latency_us * m_rate / 1000000;
+            // halving the period doubles the share of it the sink needs
+            if(m_periodFrames > (int)targetFrames && load * 2 <= m_config.max_sink_load
+               && (m_overrunPeriod == 0 || m_periodFrames / 2 > m_overrunPeriod)){
+                next = m_periodFrames / 2;
+            } else if((uint64_t)m_periodFrames * 2 <= targetFrames){
+                next = m_periodFrames * 2;
+            }
+        }
+        next = std::max(m_config.min_period, std::min(m_config.max_period, next));
+        LOG_INFO("Take: %lu periods, %lu xruns, sink max %lu ns avg %lu ns -> period %d (was %d)",
+               (unsigned long)m_periods, (unsigned long)m_xruns, (unsigned long)m_maxSinkNs,
+               (unsigned long)(m_sumSinkNs / m_periods), next, m_periodFrames);
+        return next;
+    };
+
+private:
+    static constexpr uint64_t MIN_PERIODS = 32;
+
+    AdaptiveConfig m_config;
+    unsigned int m_rate = 48000;
+    int m_periodFrames = 0;
+    uint64_t m_periodTimeNs = 0;
+    uint64_t m_periods = 0;
+    uint64_t m_xruns = 0;
+    uint64_t m_maxSinkNs = 0;
+    uint64_t m_sumSinkNs = 0;
+    // smallest period with xruns or an overloaded sink so far, 0 = none
+    int m_overrunPeriod = 0;
+};
+
+#endif
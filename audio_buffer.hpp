@@ -25,7 +25,9 @@ SOFTWARE.
 #ifndef _AUDIO_BUFFER_H_
 #define _AUDIO_BUFFER_H_
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <mutex>
 #include <stdint.h>
 
@@ -66,25 +68,22 @@ public:
     void add(uint8_t* data, uint64_t size){
         std::lock_guard<std::mutex> lock(m_mutex);
         // Cases
-        // size = maxSize -> (easy)  memcpy(m_audioBuffer + 0, data + 0, size); m_pos += size % maxSize // +0;
-        // size > maxSize -> add last n bytes. n = maxSize, data += (size - maxSize), m_pos += n % maxSize
-        // size < maxSize
-        //      m_pos + size < maxSize -> memcpy(m_audioBuffer + m_pos, data + 0, size); m_pos += size % maxSize // + size;
-        //      m_pos + size > maxSize -> memcpy(m_audioBuffer + m_pos, data + 0, size - off1); // update pos; memcpy(m_audioBuffer + m_pos, data + off2, size - off3);
-        bool exceedsMaxSize = size >= m_maxSize;
-        bool hasRollover = ((m_pos + size) > m_maxSize) && !exceedsMaxSize;
-        uint64_t sizeToAdd = (hasRollover || exceedsMaxSize) * (m_maxSize - m_pos) + !hasRollover * size;
-        uint64_t dataOffset = exceedsMaxSize * (size - m_maxSize) + !exceedsMaxSize * 0;
-        uint64_t bufferOffset = exceedsMaxSize * 0 + !exceedsMaxSize * m_pos;
-    
-        memcpy(m_audioBuffer + bufferOffset, data + dataOffset, sizeToAdd);
-        if(hasRollover){
-            uint64_t remaining = size - sizeToAdd;
-            uint64_t off2 = sizeToAdd;
-            memcpy(m_audioBuffer + 0, data + off2, remaining);
+        // size >= maxSize -> only the last maxSize bytes survive, they fill the whole buffer
+        // m_pos + size <= maxSize -> memcpy(m_audioBuffer + m_pos, data, size)
+        // m_pos + size > maxSize -> fill up to the end, continue at the start
+        if(size >= m_maxSize){
+            memcpy(m_audioBuffer, data + (size - m_maxSize), m_maxSize);
+            m_pos = 0;
+            m_size = m_maxSize;
+            return;
         }
-        m_size = full() ? m_maxSize : m_size + sizeToAdd;
-        m_pos += size;
+        uint64_t first = std::min(size, m_maxSize - m_pos);
+        memcpy(m_audioBuffer + m_pos, data, first);
+        if(first < size){
+            memcpy(m_audioBuffer, data + first, size - first);
+        }
+        m_size = std::min(m_size + size, m_maxSize);
+        m_pos = (m_pos + size) % m_maxSize;
     }
 
     bool full(){
@@ -0,0 +1,435 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _BATCH_PROCESSOR_H_
+#define _BATCH_PROCESSOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "common.hpp"
+#include "config.hpp"
+#include "capture_handle.hpp"
+#include "file_source.hpp"
+#include "seek_index.hpp"
+#include "peak_pyramid.hpp"
+#include "snd_pcm_params.hpp"
+#include "work_stealing_pool.hpp"
+
+struct ChannelStats{
+    int32_t min = INT32_MAX;
+    int32_t max = INT32_MIN;
+    double sumSquares = 0;
+    uint64_t samples = 0;
+    uint64_t clipped = 0;       // samples at the limits of the format
+
+    double rms() const {
+        return samples > 0 ? std::sqrt(sumSquares / samples) : 0.0;
+    };
+
+    void merge(const ChannelStats& other){
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        sumSquares += other.sumSquares;
+        samples += other.samples;
+        clipped += other.clipped;
+    };
+};
+
+struct BatchFileResult{
+    std::string input = "";
+    bool ok = false;
+    uint64_t frames = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    std::vector<ChannelStats> channels;     // of the kept channels, if analyzed
+};
+
+struct BatchReport{
+    std::vector<BatchFileResult> files;
+    unsigned int threads = 0;
+    uint64_t frames = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t tasks = 0;
+    uint64_t steals = 0;
+    double seconds = 0;
+
+    double mbPerSecIn() const {
+        return seconds > 0 ? bytesIn / (1024.0 * 1024.0) / seconds : 0.0;
+    };
+
+    double framesPerSec() const {
+        return seconds > 0 ? frames / seconds : 0.0;
+    };
+};
+
+/*
+ * Offline processing of existing recordings. Inputs are mapped, split into chunks and
+ * the chunks of all files are spread over a work stealing pool. Per chunk the kept
+ * channels are extracted, analysed and written to their final place in the output, so
+ * chunks finish in any order. That is also why samples are not written through
+ * CaptureHandle, which only appends in order. Output header, seek index and peaks are
+ * written by the same code as during capture once the last chunk of a file is done.
+ */
+class BatchProcessor{
+public:
+    BatchProcessor(BatchConfig config) : m_config(config) {
+        TR_MSG("BatchProcessor");
+    };
+
+    bool run(const std::vector<BatchJob>& jobs, BatchReport& report){
+        TR();
+        MSG_AND_RETURN_IF(m_config.chunk_frames == 0, false, "Invalid chunk size");
+        WorkStealingPool pool;
+        MSG_AND_RETURN_IF(!pool.init(m_config.threads), false, "Could not start workers");
+        auto begin = std::chrono::steady_clock::now();
+
+        std::vector<std::unique_ptr<FileState>> files;
+        for(const BatchJob& job : jobs){
+            files.emplace_back(new FileState());
+            FileState* file = files.back().get();
+            file->job = job;
+            file->result.input = job.input_file;
+            pool.submit([this, &pool, file]{ openFile(pool, *file); });
+        }
+        pool.wait();
+
+        report = BatchReport();
+        report.threads = pool.size();
+        report.tasks = pool.getExecuted();
+        report.steals = pool.getStolen();
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        bool ok = true;
+        for(auto& file : files){
+            ok &= file->result.ok;
+            report.frames += file->result.frames;
+            report.bytesIn += file->result.bytesIn;
+            report.bytesOut += file->result.bytesOut;
+            report.files.push_back(file->result);
+        }
+        LOG_INFO("%zu files, %lu frames, %.1f MB in %.3f s: %.1f MB/s on %u threads (%lu tasks, %lu stolen)",
+                 files.size(), (unsigned long)report.frames, report.bytesIn / (1024.0 * 1024.0), report.seconds,
+                 report.mbPerSecIn(), report.threads, (unsigned long)report.tasks, (unsigned long)report.steals);
+        return ok;
+    };
+
+private:
+    struct FileState{
+        BatchJob job;
+        BatchFileResult result;
+        AudioFileInfo info;
+        int fd = -1;
+        int outFd = -1;
+        const uint8_t* map = nullptr;
+        size_t mapSize = 0;
+        int bytesPerChannel = 0;
+        int bytesPerFrame = 0;
+        int outBytesPerFrame = 0;
+        snd_pcm_format_t outFormat = SND_PCM_FORMAT_UNKNOWN;
+        uint64_t outDataOffset = 0;
+        std::vector<unsigned int> channels;
+        std::atomic<uint64_t> remaining{0};
+        std::atomic<bool> failed{false};
+        std::mutex mutex;
+
+        ~FileState(){
+            close();
+        };
+
+        void close(){
+            if(map){
+                (void)munmap(const_cast<uint8_t*>(map), mapSize);
+                map = nullptr;
+            }
+            if(fd >= 0){
+                (void)::close(fd);
+                fd = -1;
+            }
+            if(outFd >= 0){
+                (void)::close(outFd);
+                outFd = -1;
+            }
+        };
+    };
+
+    BatchConfig m_config;
+
+    void openFile(WorkStealingPool& pool, FileState& file){
+        if(!prepare(file)){
+            LOG_ERROR("Skip %s", file.job.input_file.c_str());
+            file.close();
+            return;
+        }
+        uint64_t frames = file.result.frames;
+        uint64_t chunks = frames == 0 ? 0 : (frames - 1) / m_config.chunk_frames + 1;
+        if(chunks == 0){
+            finish(file);
+            return;
+        }
+        file.remaining = chunks;
+        for(uint64_t i = 0; i < chunks; i++){
+            uint64_t first = i * m_config.chunk_frames;
+            uint64_t count = std::min<uint64_t>(m_config.chunk_frames, frames - first);
+            pool.submit([this, &file, first, count]{ processChunk(file, first, count); });
+        }
+    };
+
+    bool prepare(FileState& file){
+        file.fd = ::open(file.job.input_file.c_str(), O_RDONLY);
+        MSG_AND_RETURN_IF(file.fd < 0, false, "Can not open %s", file.job.input_file.c_str());
+        MSG_AND_RETURN_IF(!probeAudioFile(file.fd, m_config.raw_input, file.info), false, "Can not read %s", file.job.input_file.c_str());
+        auto it = format2bytes.find(file.info.format);
+        MSG_AND_RETURN_IF(it == format2bytes.end() || file.info.channels == 0, false, "Unsupported format %d", file.info.format);
+        file.bytesPerChannel = it->second;
+        file.bytesPerFrame = file.bytesPerChannel * file.info.channels;
+        file.result.frames = file.info.dataSize / file.bytesPerFrame;
+        file.result.bytesIn = file.result.frames * file.bytesPerFrame;
+
+        file.channels = file.job.channels;
+        if(file.channels.empty()){
+            for(unsigned int c = 0; c < file.info.channels; c++){
+                file.channels.push_back(c);
+            }
+        }
+        for(unsigned int c : file.channels){
+            MSG_AND_RETURN_IF(c >= file.info.channels, false, "%s has no channel %u", file.job.input_file.c_str(), c);
+        }
+        MSG_AND_RETURN_IF(!file.job.output_file.empty() && (file.job.output_mode & CAPTURE_MODE::WAV) && (file.job.output_mode & CAPTURE_MODE::RAW),
+                          false, "%s: output mode is WAV or RAW, not both", file.job.output_file.c_str());
+        // raw output keeps the samples as they are, wav only knows U8 and S16_LE
+        bool wav = !file.job.output_file.empty() && (file.job.output_mode & CAPTURE_MODE::WAV);
+        file.outFormat = wav ? wavFormat(file.info.format) : file.info.format;
+        MSG_AND_RETURN_IF(file.outFormat == SND_PCM_FORMAT_UNKNOWN, false, "Format %d can not be written as wav", file.info.format);
+        file.outBytesPerFrame = file.bytesPerChannel * file.channels.size();
+        file.result.channels.assign(file.channels.size(), ChannelStats());
+
+        if(file.result.bytesIn > 0){
+            file.mapSize = file.info.dataOffset + file.result.bytesIn;
+            void* mem = mmap(nullptr, file.mapSize, PROT_READ, MAP_SHARED, file.fd, 0);
+            MSG_AND_RETURN_IF(mem == MAP_FAILED, false, "mmap %s failed", file.job.input_file.c_str());
+            file.map = static_cast<const uint8_t*>(mem);
+        }
+
+        if(!file.job.output_file.empty()){
+            file.outDataOffset = wav ? sizeof(WAV_HEADER) : 0;
+            file.outFd = ::open(file.job.output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            MSG_AND_RETURN_IF(file.outFd < 0, false, "Can not create %s", file.job.output_file.c_str());
+            // final size up front, chunks are written to their place in any order
+            uint64_t outSize = file.outDataOffset + file.result.frames * file.outBytesPerFrame;
+            MSG_AND_RETURN_IF(ftruncate(file.outFd, outSize) < 0, false, "Can not size %s", file.job.output_file.c_str());
+            file.result.bytesOut = outSize;
+        }
+        return true;
+    };
+
+    void processChunk(FileState& file, uint64_t first, uint64_t count){
+        if(!file.failed){
+            const uint8_t* src = file.map + file.info.dataOffset + first * file.bytesPerFrame;
+            size_t srcSize = count * file.bytesPerFrame;
+            (void)madvise(const_cast<uint8_t*>(pageAlign(src)), srcSize + (src - pageAlign(src)), MADV_WILLNEED);
+            bool ok = true;
+            if(file.job.analyze){
+                std::vector<ChannelStats> stats(file.channels.size());
+                analyze(file, src, count, stats);
+                std::lock_guard<std::mutex> lock(file.mutex);
+                for(size_t c = 0; c < stats.size(); c++){
+                    file.result.channels[c].merge(stats[c]);
+                }
+            }
+            if(file.outFd >= 0){
+                ok = writeChunk(file, src, first, count);
+            }
+            if(!ok){
+                file.failed = true;
+            }
+        }
+        if(file.remaining.fetch_sub(1) == 1){
+            finish(file);
+        }
+    };
+
+    bool writeChunk(FileState& file, const uint8_t* src, uint64_t first, uint64_t count){
+        off_t pos = file.outDataOffset + first * file.outBytesPerFrame;
+        bool allChannels = file.channels.size() == file.info.channels;
+        for(size_t c = 0; c < file.channels.size() && allChannels; c++){
+            allChannels = file.channels[c] == c;
+        }
+        const bool convert = file.outFormat != file.info.format;
+        if(allChannels && !convert){
+            // container change only, straight from the mapping
+            return writeAll(file.outFd, src, count * file.bytesPerFrame, pos);
+        }
+        std::vector<uint8_t> out(count * file.outBytesPerFrame);
+        const size_t bpc = file.bytesPerChannel;
+        uint8_t* dst = out.data();
+        for(uint64_t f = 0; f < count; f++){
+            const uint8_t* frame = src + f * file.bytesPerFrame;
+            for(unsigned int c : file.channels){
+                if(convert){
+                    encodeSample(file.outFormat, decodeSample(file.info.format, frame + c * bpc), dst);
+                } else {
+                    memcpy(dst, frame + c * bpc, bpc);
+                }
+                dst += bpc;
+            }
+        }
+        return writeAll(file.outFd, out.data(), out.size(), pos);
+    };
+
+    void analyze(const FileState& file, const uint8_t* src, uint64_t count, std::vector<ChannelStats>& stats){
+        const snd_pcm_format_t format = file.info.format;
+        int32_t lo = 0;
+        int32_t hi = 0;
+        sampleRange(format, lo, hi);
+        for(size_t i = 0; i < file.channels.size(); i++){
+            ChannelStats& st = stats[i];
+            const uint8_t* p = src + file.channels[i] * file.bytesPerChannel;
+            int32_t mn = INT32_MAX;
+            int32_t mx = INT32_MIN;
+            double sum = 0;
+            uint64_t clipped = 0;
+            for(uint64_t f = 0; f < count; f++, p += file.bytesPerFrame){
+                int32_t v = decodeSample(format, p);
+                mn = std::min(mn, v);
+                mx = std::max(mx, v);
+                sum += (double)v * v;
+                clipped += (v <= lo || v >= hi) ? 1 : 0;
+            }
+            st.min = mn;
+            st.max = mx;
+            st.sumSquares = sum;
+            st.samples = count;
+            st.clipped = clipped;
+        }
+    };
+
+    void finish(FileState& file){
+        bool ok = !file.failed;
+        if(ok && file.outFd >= 0){
+            HwConfig out = m_config.raw_input;
+            out.channels = file.channels.size();
+            out.rate = file.info.rate;
+            out.format = file.outFormat;
+            if(file.job.output_mode & CAPTURE_MODE::WAV){
+                WAV_HEADER header = makeWavHeader(out, file.outBytesPerFrame);
+                uint64_t dataSize = file.result.frames * file.outBytesPerFrame;
+                header.size_of_data = (uint32_t)std::min<uint64_t>(dataSize, UINT32_MAX);
+                header.chunk_data_size = (uint32_t)std::min<uint64_t>(dataSize + sizeof(WAV_HEADER) - 8, UINT32_MAX);
+                ok = writeAll(file.outFd, reinterpret_cast<const uint8_t*>(&header), sizeof(header), 0);
+            }
+            if(ok && file.job.write_seek_index){
+                SeekIndexWriter index;
+                ok = index.init(file.job.output_file + SEEK_INDEX_SUFFIX, file.outDataOffset, 0, out, file.outBytesPerFrame)
+                     && index.add(file.result.frames, nullptr);
+            }
+            if(ok && file.job.write_peaks){
+                // without a matching header the writer builds all levels from the output
+                (void)std::remove((file.job.output_file + PEAK_PYRAMID_SUFFIX).c_str());
+                PeakPyramidWriter peaks;
+                ok = peaks.init(file.job.output_file, out, file.outBytesPerFrame, m_config.peak_bin_frames,
+                                file.outDataOffset, file.result.frames);
+                peaks.close();
+            }
+        }
+        file.close();
+        file.result.ok = ok;
+        if(!ok){
+            LOG_ERROR("Processing %s failed", file.job.input_file.c_str());
+        }
+    };
+
+    static bool writeAll(int fd, const uint8_t* data, size_t size, off_t pos){
+        while(size > 0){
+            ssize_t res = pwrite(fd, data, size, pos);
+            if(res < 0 && errno == EINTR){
+                continue;
+            }
+            MSG_AND_RETURN_IF(res <= 0, false, "Write failed: %s", strerror(errno));
+            data += res;
+            size -= res;
+            pos += res;
+        }
+        return true;
+    };
+
+    static const uint8_t* pageAlign(const uint8_t* p){
+        static const uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+        return reinterpret_cast<const uint8_t*>((uintptr_t)p & ~(pageSize - 1));
+    };
+
+    // signed value of a sample, unsigned formats are centered around 0
+    static int32_t decodeSample(snd_pcm_format_t format, const uint8_t* p){
+        switch(format){
+            case SND_PCM_FORMAT_S8:     return (int8_t)p[0];
+            case SND_PCM_FORMAT_U8:     return (int32_t)p[0] - 0x80;
+            case SND_PCM_FORMAT_S16_LE: return (int16_t)(p[0] | (p[1] << 8));
+            case SND_PCM_FORMAT_S16_BE: return (int16_t)((p[0] << 8) | p[1]);
+            case SND_PCM_FORMAT_U16_LE: return (int32_t)(p[0] | (p[1] << 8)) - 0x8000;
+            case SND_PCM_FORMAT_U16_BE: return (int32_t)((p[0] << 8) | p[1]) - 0x8000;
+            default:                    return 0;
+        }
+    };
+
+    // the wav format a sample format is written as, same size
+    static snd_pcm_format_t wavFormat(snd_pcm_format_t format){
+        switch(format){
+            case SND_PCM_FORMAT_S8:
+            case SND_PCM_FORMAT_U8:     return SND_PCM_FORMAT_U8;
+            case SND_PCM_FORMAT_S16_LE:
+            case SND_PCM_FORMAT_S16_BE:
+            case SND_PCM_FORMAT_U16_LE:
+            case SND_PCM_FORMAT_U16_BE: return SND_PCM_FORMAT_S16_LE;
+            default:                    return SND_PCM_FORMAT_UNKNOWN;
+        }
+    };
+
+    // inverse of decodeSample for the wav formats
+    static void encodeSample(snd_pcm_format_t format, int32_t value, uint8_t* p){
+        if(format == SND_PCM_FORMAT_U8){
+            p[0] = (uint8_t)(value + 0x80);
+        } else {
+            p[0] = (uint8_t)(value & 0xFF);
+            p[1] = (uint8_t)((value >> 8) & 0xFF);
+        }
+    };
+
+    static void sampleRange(snd_pcm_format_t format, int32_t& lo, int32_t& hi){
+        bool eightBit = format == SND_PCM_FORMAT_S8 || format == SND_PCM_FORMAT_U8;
+        lo = eightBit ? INT8_MIN : INT16_MIN;
+        hi = eightBit ? INT8_MAX : INT16_MAX;
+    };
+};
+
+#endif
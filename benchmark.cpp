@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "config.hpp"
+#include "audio_buffer.hpp"
+#include "capture_handle.hpp"
+#include "peak_pyramid.hpp"
+#include "handle.hpp"
+#include "snd_pcm_params.hpp"
+#include "pcm_io.hpp"
+#include "batch_processor.hpp"
+
+/*
+ * Microbenchmarks of the capture hot paths. Every benchmark times each call on its own,
+ * results are written as one JSON object per line (to stdout or to the file given as
+ * first argument) so they can be compared between builds:
+ *   {"name":..., "calls":..., "frames_per_sec":..., "mb_per_sec":..., "p50_ns":..., ...}
+ */
+
+using Clock = std::chrono::steady_clock;
+
+constexpr unsigned int BENCH_CHANNELS = 2;
+constexpr unsigned int BENCH_RATE = 48000;
+constexpr int BENCH_BYTES_PER_SAMPLE = 2 * BENCH_CHANNELS;
+constexpr size_t BENCH_PERIOD_FRAMES = 512;
+constexpr size_t BENCH_PERIOD_BYTES = BENCH_PERIOD_FRAMES * BENCH_BYTES_PER_SAMPLE;
+
+struct BenchResult{
+    std::string name;
+    size_t calls = 0;
+    size_t bytesPerCall = 0;
+    double seconds = 0;
+    std::vector<uint64_t> latencyNs;
+};
+
+static FILE* out = stdout;
+
+// run fn calls times after a short warm up, fn returns false to abort
+static bool runBench(const std::string& name, size_t calls, size_t bytesPerCall, const std::function<bool()>& fn){
+    for(size_t i = 0; i < std::min<size_t>(calls / 10, 1000); i++){
+        if(!fn()){
+            fprintf(stderr, "%s: warm up failed, skipped\n", name.c_str());
+            return false;
+        }
+    }
+    BenchResult res;
+    res.name = name;
+    res.bytesPerCall = bytesPerCall;
+    res.latencyNs.reserve(calls);
+    Clock::time_point begin = Clock::now();
+    for(size_t i = 0; i < calls; i++){
+        Clock::time_point t0 = Clock::now();
+        if(!fn()){
+            fprintf(stderr, "%s: failed after %zu calls\n", name.c_str(), i);
+            return false;
+        }
+        res.latencyNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count());
+    }
+    res.seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+    res.calls = calls;
+
+    std::sort(res.latencyNs.begin(), res.latencyNs.end());
+    auto pct = [&res](double p){
+        return res.latencyNs[std::min(res.latencyNs.size() - 1, (size_t)(p * res.latencyNs.size()))];
+    };
+    double bytes = (double)res.bytesPerCall * res.calls;
+    fprintf(out, "{\"name\":\"%s\",\"calls\":%zu,\"bytes_per_call\":%zu,\"seconds\":%.6f,"
+                 "\"frames_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+                 "\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}\n",
+            res.name.c_str(), res.calls, res.bytesPerCall, res.seconds,
+            bytes / BENCH_BYTES_PER_SAMPLE / res.seconds, bytes / (1024.0 * 1024.0) / res.seconds,
+            (unsigned long)pct(0.5), (unsigned long)pct(0.9), (unsigned long)pct(0.99),
+            (unsigned long)pct(0.999), (unsigned long)res.latencyNs.back());
+    fflush(out);
+    return true;
+}
+
+static HwConfig benchHwConfig(){
+    HwConfig config{};
+    config.channels = BENCH_CHANNELS;
+    config.rate = BENCH_RATE;
+    config.format = SND_PCM_FORMAT_S16_LE;
+    return config;
+}
+
+static void benchAudioBuffer(std::vector<uint8_t>& period){
+    AudioBuffer buffer;
+    // a multiple of the period: add never wraps inside a call
+    if(!buffer.init(BENCH_PERIOD_BYTES * 256)){
+        return;
+    }
+    runBench("audio_buffer_add_no_wrap", 200000, period.size(), [&]{
+        buffer.add(period.data(), period.size());
+        return true;
+    });
+    // not a multiple of the period: most calls wrap around the end
+    AudioBuffer wrapping;
+    if(!wrapping.init(BENCH_PERIOD_BYTES + BENCH_PERIOD_BYTES / 3)){
+        return;
+    }
+    runBench("audio_buffer_add_wrap", 200000, period.size(), [&]{
+        wrapping.add(period.data(), period.size());
+        return true;
+    });
+}
+
+static void benchPeaks(std::vector<uint8_t>& period, const std::string& dir){
+    // the reduction alone, one level 0 bin per call
+    std::vector<PeakAccumulator> acc(BENCH_CHANNELS);
+    runBench("peak_reduce_s16", 200000, period.size(), [&]{
+        reduceS16(reinterpret_cast<const int16_t*>(period.data()), BENCH_PERIOD_FRAMES, BENCH_CHANNELS, acc.data());
+        return acc[0].min <= acc[0].max;
+    });
+    // all levels including the file writes
+    std::string file = dir + "/arecord_bench_peaks.raw";
+    {
+        PeakPyramidWriter writer;
+        if(!writer.init(file, benchHwConfig(), BENCH_BYTES_PER_SAMPLE, {256, 4096, 65536})){
+            fprintf(stderr, "peak_pyramid_add: init failed, skipped\n");
+            return;
+        }
+        runBench("peak_pyramid_add", 200000, period.size(), [&]{
+            writer.add(period.data(), BENCH_PERIOD_FRAMES);
+            return true;
+        });
+    }
+    (void)std::remove((file + PEAK_PYRAMID_SUFFIX).c_str());
+    for(size_t level = 0; level < 3; level++){
+        (void)std::remove(peakLevelFileName(file, level).c_str());
+    }
+}
+
+static void benchCaptureWrite(const std::string& name, CaptureConfig capture, std::vector<uint8_t>& period, size_t calls){
+    HwConfig config = benchHwConfig();
+    CaptureHandle handle(capture);
+    if(!handle.init(config, BENCH_BYTES_PER_SAMPLE)){
+        fprintf(stderr, "%s: init failed, skipped\n", name.c_str());
+        return;
+    }
+    runBench(name, calls, period.size(), [&]{
+        return handle.write(period.data(), period.size());
+    });
+}
+
+static void benchCaptureSinks(std::vector<uint8_t>& period, const std::string& dir){
+    CaptureConfig raw{};
+    raw.mode = CAPTURE_MODE::RAW;
+    raw.raw_file_name = dir + "/arecord_bench.raw";
+    benchCaptureWrite("capture_write_raw", raw, period, 20000);
+
+    CaptureConfig wav{};
+    wav.mode = CAPTURE_MODE::WAV;
+    wav.wav_file_name = dir + "/arecord_bench.wav";
+    benchCaptureWrite("capture_write_wav", wav, period, 20000);
+
+    // what each durability policy costs the capture thread
+    CaptureConfig unsynced = wav;
+    unsynced.durability = DURABILITY::NONE;
+    benchCaptureWrite("capture_write_wav_sync_none", unsynced, period, 20000);
+    CaptureConfig interval = wav;
+    interval.sync_interval_ms = 100;
+    benchCaptureWrite("capture_write_wav_sync_100ms", interval, period, 20000);
+    CaptureConfig everyPeriod = wav;
+    everyPeriod.durability = DURABILITY::PERIOD;
+    benchCaptureWrite("capture_write_wav_sync_period", everyPeriod, period, 2000);
+
+    CaptureConfig indexed = raw;
+    indexed.write_seek_index = true;
+    benchCaptureWrite("capture_write_raw_seek_index", indexed, period, 20000);
+
+    CaptureConfig shm{};
+    shm.mode = CAPTURE_MODE::SHM;
+    shm.shm_name = "/arecord_bench";
+    benchCaptureWrite("capture_write_shm", shm, period, 200000);
+
+    // stdout goes to /dev/null for the duration of the benchmark, results to the real stdout
+    fflush(stdout);
+    int saved = dup(1);
+    int devNull = open("/dev/null", O_WRONLY);
+    if(saved >= 0 && devNull >= 0 && dup2(devNull, 1) >= 0){
+        FILE* prev = out;
+        if(out == stdout){
+            out = fdopen(dup(saved), "w");
+        }
+        if(out){
+            CaptureConfig console{};
+            console.mode = CAPTURE_MODE::STDOUT;
+            benchCaptureWrite("capture_write_stdout", console, period, 200000);
+        }
+        if(out && out != prev){
+            fclose(out);
+        }
+        out = prev;
+        (void)dup2(saved, 1);
+    }
+    if(devNull >= 0){
+        (void)close(devNull);
+    }
+    if(saved >= 0){
+        (void)close(saved);
+    }
+
+    (void)std::remove(raw.raw_file_name.c_str());
+    (void)std::remove((raw.raw_file_name + SEEK_INDEX_SUFFIX).c_str());
+    (void)std::remove(wav.wav_file_name.c_str());
+}
+
+// the alsa null plugin delivers silence without a device, this measures the library overhead
+// the same job on 1, 2, 4 .. threads up to the number of cores, to see how it scales
+static void benchBatch(const std::vector<uint8_t>& period, const std::string& dir){
+    constexpr size_t BATCH_PERIODS = 16384;
+    std::string input = dir + "/arecord_bench_batch.raw";
+    std::string output = dir + "/arecord_bench_batch.wav";
+    int fd = open(input.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0;
+    for(size_t i = 0; i < BATCH_PERIODS && ok; i++){
+        ok = write(fd, period.data(), period.size()) == (ssize_t)period.size();
+    }
+    if(fd >= 0){
+        (void)close(fd);
+    }
+    if(!ok){
+        fprintf(stderr, "batch: could not create input, skipped\n");
+        (void)std::remove(input.c_str());
+        return;
+    }
+    BatchJob job;
+    job.input_file = input;
+    job.output_file = output;
+    job.channels = {0};
+    std::vector<BatchJob> jobs(1, job);
+    // all channels, the same bytes read as S16_BE: every sample goes through decode and encode
+    job.channels.clear();
+    std::vector<BatchJob> convertJobs(1, job);
+
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned int> threads;
+    for(unsigned int t = 1; t < cores; t *= 2){
+        threads.push_back(t);
+    }
+    threads.push_back(cores);
+    for(unsigned int t : threads){
+        BatchConfig config;
+        config.threads = t;
+        config.chunk_frames = 1 << 16;
+        config.raw_input = benchHwConfig();
+        runBench("batch_extract_" + std::to_string(t) + "_threads", 10, BATCH_PERIODS * period.size(), [&]{
+            BatchProcessor processor(config);
+            BatchReport report;
+            return processor.run(jobs, report);
+        });
+        config.raw_input.format = SND_PCM_FORMAT_S16_BE;
+        runBench("batch_s16be_to_wav_" + std::to_string(t) + "_threads", 10, BATCH_PERIODS * period.size(), [&]{
+            BatchProcessor processor(config);
+            BatchReport report;
+            return processor.run(convertJobs, report);
+        });
+    }
+    (void)std::remove(input.c_str());
+    (void)std::remove(output.c_str());
+}
+
+static void benchReadFromPcm(const std::string& pcm){
+    HwConfig config = benchHwConfig();
+    config.pcm_name = pcm;
+    config.size_near = BENCH_PERIOD_FRAMES;
+    Handle handle;
+    HwParams params;
+    if(!handle.init(config) || !params.init(handle.get(), config)){
+        fprintf(stderr, "read_from_pcm: pcm %s not available, skipped\n", pcm.c_str());
+        return;
+    }
+    int frames = params.getPeriodSizeInSamples();
+    int bytesPerSample = params.getBytesPerSample();
+    if(frames <= 0 || bytesPerSample <= 0){
+        return;
+    }
+    std::vector<uint8_t> buffer(frames * bytesPerSample);
+    XrunStats stats;
+    bool mmapAccess = isMmapAccess(config.access_mode);
+    runBench("read_from_pcm_" + pcm, 20000, buffer.size(), [&]{
+        size_t read = 0;
+        bool xrun = false;
+        return readFromPcm(handle.get(), mmapAccess, buffer.data(), frames, bytesPerSample, read, stats, xrun);
+    });
+}
+
+int main(int argc, char** argv){
+    if(argc > 1){
+        out = fopen(argv[1], "w");
+        if(out == nullptr){
+            fprintf(stderr, "could not open %s\n", argv[1]);
+            return 1;
+        }
+    }
+    const char* tmp = getenv("TMPDIR");
+    std::string dir = tmp ? tmp : "/tmp";
+
+    std::vector<uint8_t> period(BENCH_PERIOD_BYTES);
+    for(size_t i = 0; i < period.size(); i++){
+        period[i] = (uint8_t)(i * 31);
+    }
+
+    benchAudioBuffer(period);
+    benchPeaks(period, dir);
+    benchCaptureSinks(period, dir);
+    benchBatch(period, dir);
+    benchReadFromPcm("null");
+
+    if(out != stdout){
+        fclose(out);
+    }
+    return 0;
+}
@@ -26,7 +26,13 @@ SOFTWARE.
 
 #include "common.hpp"
 #include "config.hpp"
+#include "shm_ring.hpp"
+#include "seek_index.hpp"
+#include "period_clock.hpp"
+#include "peak_pyramid.hpp"
+#include "group_commit.hpp"
 
+#include <algorithm>
 #include <string>
 #include <fstream>
 #include <stdlib.h>
@@ -49,12 +55,109 @@ struct WAV_HEADER {
   uint32_t size_of_data = 0;                // length of sampled data                   40-43
 };
 
-void setU32LEinStream(std::fstream& ss, uint32_t val){
-    ss.put((uint8_t)((val & 0x000000FF)));
-    ss.put((uint8_t)((val & 0x0000FF00) >> 8));
-    ss.put((uint8_t)((val & 0x00FF0000) >> 16));
-    ss.put((uint8_t)((val & 0xFF000000) >> 24));
-    return;
+// bytesPerSample: bytes of one frame (all channels)
+WAV_HEADER makeWavHeader(const HwConfig& streamInfo, int bytesPerSample){
+    WAV_HEADER header;
+    header.channels = streamInfo.channels;
+    header.rate = streamInfo.rate;
+    header.bytes_per_sec = streamInfo.rate * bytesPerSample;
+    header.bits_per_sample = bytesPerSample * BITS_PER_BYTE / std::max(1u, streamInfo.channels);
+    header.block_alignment = bytesPerSample;
+    return header;
+}
+
+inline bool pwriteU32LE(int fd, uint32_t val, uint64_t pos){
+    uint8_t bytes[4] = {(uint8_t)(val & 0xFF), (uint8_t)((val >> 8) & 0xFF), (uint8_t)((val >> 16) & 0xFF), (uint8_t)(val >> 24)};
+    return pwrite(fd, bytes, sizeof(bytes), pos) == sizeof(bytes);
+}
+
+// sets the riff and data sizes of a file starting with WAV_HEADER to match fileLength
+inline bool writeWavSizes(int fd, uint64_t fileLength){
+    constexpr size_t POS_CHUNK_DATA_SIZE = 4;
+    constexpr size_t POS_SAMPLE_DATA_SIZE = 40;
+    if(fileLength < sizeof(WAV_HEADER)){
+        return false;
+    }
+    // sizes are 32 bit, larger files are still readable by tools that ignore them
+    uint32_t chunkSize = (uint32_t)std::min<uint64_t>(fileLength - 8, UINT32_MAX);
+    uint32_t dataSize = (uint32_t)std::min<uint64_t>(fileLength - sizeof(WAV_HEADER), UINT32_MAX);
+    return pwriteU32LE(fd, chunkSize, POS_CHUNK_DATA_SIZE) && pwriteU32LE(fd, dataSize, POS_SAMPLE_DATA_SIZE);
+}
+
+struct WavRepair{
+    uint64_t fileLength = 0;
+    uint64_t dataOffset = 0;
+    uint32_t oldRiffSize = 0;
+    uint32_t oldDataSize = 0;
+    uint32_t riffSize = 0;
+    uint32_t dataSize = 0;
+    // trailing bytes that do not make up a whole frame
+    uint64_t partialFrameBytes = 0;
+};
+
+/*
+ * Recompute the riff and data sizes of a wav file from its length, e.g. after a crash.
+ * The data chunk has to be the last chunk, as in files written by CaptureHandle.
+ * dryRun: only fill result. truncate: cut a partial last frame off the file.
+ */
+inline bool repairWavHeader(const std::string& fileName, bool dryRun, bool truncate, WavRepair& result){
+    int fd = open(fileName.c_str(), dryRun ? O_RDONLY : O_RDWR);
+    MSG_AND_RETURN_IF(fd < 0, false, "Can not open %s", fileName.c_str());
+    struct stat st;
+    uint8_t riff[12];
+    bool ok = fstat(fd, &st) == 0 && pread(fd, riff, sizeof(riff), 0) == sizeof(riff)
+              && memcmp(riff, "RIFF", 4) == 0 && memcmp(riff + 8, "WAVE", 4) == 0;
+    if(!ok){
+        (void)::close(fd);
+        LOG_ERROR("%s is no wav file", fileName.c_str());
+        return false;
+    }
+    result.fileLength = st.st_size;
+    result.oldRiffSize = riff[4] | (riff[5] << 8) | (riff[6] << 16) | ((uint32_t)riff[7] << 24);
+    uint32_t blockAlign = 0;
+    uint64_t pos = sizeof(riff);
+    while(pos + 8 <= result.fileLength){
+        uint8_t chunk[8];
+        if(pread(fd, chunk, sizeof(chunk), pos) != sizeof(chunk)){
+            break;
+        }
+        uint32_t chunkSize = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | ((uint32_t)chunk[7] << 24);
+        if(memcmp(chunk, "fmt ", 4) == 0){
+            uint8_t align[2];
+            if(chunkSize >= 16 && pread(fd, align, sizeof(align), pos + 8 + 12) == sizeof(align)){
+                blockAlign = align[0] | (align[1] << 8);
+            }
+        } else if(memcmp(chunk, "data", 4) == 0){
+            // its size is what we do not trust, stop here
+            result.dataOffset = pos + 8;
+            result.oldDataSize = chunkSize;
+            break;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    if(result.dataOffset == 0 || blockAlign == 0){
+        (void)::close(fd);
+        LOG_ERROR("%s has no fmt or data chunk", fileName.c_str());
+        return false;
+    }
+    uint64_t data = result.fileLength - result.dataOffset;
+    result.partialFrameBytes = data % blockAlign;
+    data -= result.partialFrameBytes;
+    if(truncate && result.partialFrameBytes > 0){
+        result.fileLength -= result.partialFrameBytes;
+        result.partialFrameBytes = 0;
+    }
+    result.dataSize = (uint32_t)std::min<uint64_t>(data, UINT32_MAX);
+    result.riffSize = (uint32_t)std::min<uint64_t>(result.fileLength - 8, UINT32_MAX);
+    if(!dryRun){
+        ok = (!truncate || ftruncate(fd, result.fileLength) == 0)
+             && pwriteU32LE(fd, result.riffSize, 4)
+             && pwriteU32LE(fd, result.dataSize, result.dataOffset - 4)
+             && fdatasync(fd) == 0;
+    }
+    (void)::close(fd);
+    MSG_AND_RETURN_IF(!ok, false, "Can not write header of %s", fileName.c_str());
+    return true;
 }
 
 class CaptureHandle{
@@ -73,132 +176,210 @@ public:
             TR_MSG("Capture WAV");
             m_wav = true;
         }
+        if(config.mode & CAPTURE_MODE::SHM){
+            TR_MSG("Publish to shared memory");
+            m_shm = true;
+        }
         m_rawFileName = config.raw_file_name;
         m_wavFileName = config.wav_file_name;
+        m_shmName = config.shm_name;
+        m_shmSize = config.shm_size;
         m_overwrite = config.overwriteExistingFiles;
+        m_seekIndex = config.write_seek_index;
+        m_seekIndexStride = config.seek_index_stride;
+        m_writePeaks = config.write_peaks;
+        m_peakBinFrames = config.peak_bin_frames;
+        m_durability = config.durability;
+        m_syncIntervalMs = config.sync_interval_ms;
+        m_syncIntervalBytes = config.sync_interval_bytes;
     }
 
-    ~CaptureHandle(){}
+    ~CaptureHandle(){
+        close();
+    }
 
     bool init(const HwConfig& streamInfo, int bytesPerSample) {
         TR();
-        MSG_AND_RETURN_IF(m_init, true, "Already initialized");
+        LOG_AND_RETURN_IF(LOG_DEBUG, m_init, true, "Already initialized");
         if(m_raw){
-            MSG_AND_RETURN_IF(!prepareFile(m_rawFileName), false, "Could not prepare %s", m_rawFileName.c_str());
+            MSG_AND_RETURN_IF(!prepareFile(m_rawFileName, m_rawFd, m_rawLength), false, "Could not prepare %s", m_rawFileName.c_str());
+            MSG_AND_RETURN_IF(!m_rawCommit.init(m_rawFd, m_rawLength, m_durability, m_syncIntervalMs, m_syncIntervalBytes), false, "Could not register %s", m_rawFileName.c_str());
+            MSG_AND_RETURN_IF(!prepareIndex(m_rawIndex, m_rawFileName, 0, streamInfo, bytesPerSample), false, "Could not prepare index for %s", m_rawFileName.c_str());
         }
         if(m_wav){
-            MSG_AND_RETURN_IF(!prepareFile(m_wavFileName), false, "Could not prepare %s", m_wavFileName.c_str());
-            MSG_AND_RETURN_IF(!prepareWavHeader(m_wavFileName, streamInfo, bytesPerSample), false, "Could not write wav-header.");
+            MSG_AND_RETURN_IF(!prepareFile(m_wavFileName, m_wavFd, m_wavLength), false, "Could not prepare %s", m_wavFileName.c_str());
+            MSG_AND_RETURN_IF(!prepareWavHeader(streamInfo, bytesPerSample), false, "Could not write wav-header.");
+            MSG_AND_RETURN_IF(!m_wavCommit.init(m_wavFd, m_wavLength, m_durability, m_syncIntervalMs, m_syncIntervalBytes, writeWavSizes), false, "Could not register %s", m_wavFileName.c_str());
+            MSG_AND_RETURN_IF(!prepareIndex(m_wavIndex, m_wavFileName, sizeof(WAV_HEADER), streamInfo, bytesPerSample), false, "Could not prepare index for %s", m_wavFileName.c_str());
+        }
+        m_bytesPerSample = bytesPerSample;
+        if(m_writePeaks && (m_wav || m_raw)){
+            const std::string& file = m_wav ? m_wavFileName : m_rawFileName;
+            MSG_AND_RETURN_IF(!preparePeaks(file, m_wav ? sizeof(WAV_HEADER) : 0, streamInfo, bytesPerSample), false, "Could not prepare peaks for %s", file.c_str());
+        }
+        if(m_shm){
+            MSG_AND_RETURN_IF(!m_shmRing.init(m_shmName, m_shmSize, streamInfo, bytesPerSample), false, "Could not create shm ring %s", m_shmName.c_str());
         }
         m_init = true;
         return true;
     };
 
-    bool write(u_char *buff, size_t size){
+    // the next write starts a new take
+    void startTake(){
+        m_rawIndex.startSegment();
+        m_wavIndex.startSegment();
+    }
+
+    /*
+     * stamp: capture time of the first frame in buff, used for the seek index (may be null).
+     * The wav header is updated when the data is synced, see DURABILITY.
+     */
+    bool write(u_char *buff, size_t size, const PeriodStamp* stamp = nullptr){
         if(!m_init){
             return false;
         }
         if(m_wav){
-            MSG_AND_RETURN_IF(!internalWrite(m_wavFileName, buff, size), false, "Failed to write %zu bytes to %s", size, m_wavFileName.c_str());
-            MSG_AND_RETURN_IF(!updateWavHeader(m_wavFileName), false, "Failed updating Wav Header");
+            MSG_AND_RETURN_IF(!append(m_wavFd, m_wavLength, buff, size), false, "Failed to write %zu bytes to %s", size, m_wavFileName.c_str());
+            m_wavCommit.written(m_wavLength);
+            if(m_seekIndex){
+                MSG_AND_RETURN_IF(!m_wavIndex.add(size / m_bytesPerSample, stamp), false, "Failed updating index of %s", m_wavFileName.c_str());
+            }
         }
         if(m_raw){
-            MSG_AND_RETURN_IF(!internalWrite(m_rawFileName, buff, size), false, "Failed to write %zu bytes to %s", size, m_rawFileName.c_str());
+            MSG_AND_RETURN_IF(!append(m_rawFd, m_rawLength, buff, size), false, "Failed to write %zu bytes to %s", size, m_rawFileName.c_str());
+            m_rawCommit.written(m_rawLength);
+            if(m_seekIndex){
+                MSG_AND_RETURN_IF(!m_rawIndex.add(size / m_bytesPerSample, stamp), false, "Failed updating index of %s", m_rawFileName.c_str());
+            }
+        }
+        if(m_writePeaks){
+            m_peaks.add(buff, size / m_bytesPerSample);
         }
         if(m_stdout){
             int res = ::write(1, buff, size);
             MSG_AND_RETURN_IF(res < 0, false, "Write to stdout failed");
         }
+        if(m_shm){
+            m_shmRing.write(buff, size);
+        }
+        // DURABILITY::PERIOD, both files are synced in the same pass. A failed sync is fatal
+        // only here; INTERVAL keeps capturing while it is retried, see syncFailed()
+        MSG_AND_RETURN_IF(!m_wavCommit.waitSynced() || !m_rawCommit.waitSynced(), false, "Failed to sync capture data");
 
         return true;
     }
 
+    // the last background sync of a file failed, it is retried
+    bool syncFailed() const {
+        return m_wavCommit.failed() || m_rawCommit.failed();
+    }
+
+    // final sync and header update, also done by the destructor
+    bool close(){
+        bool ok = m_wavCommit.close();
+        ok &= m_rawCommit.close();
+        m_peaks.close();
+        for(int* fd : {&m_wavFd, &m_rawFd}){
+            if(*fd >= 0){
+                ok &= ::close(*fd) == 0;
+                *fd = -1;
+            }
+        }
+        m_init = false;
+        return ok;
+    }
+
 private:
     bool m_wav = false;
     bool m_stdout = false;
     bool m_raw = false;
+    bool m_shm = false;
     bool m_init = false;
     bool m_overwrite = false;
     bool m_newCreated = false;
+    bool m_seekIndex = false;
+    unsigned int m_seekIndexStride = 0;
+    bool m_writePeaks = false;
+    std::vector<unsigned int> m_peakBinFrames;
+    DURABILITY m_durability = DURABILITY::INTERVAL;
+    unsigned int m_syncIntervalMs = 0;
+    size_t m_syncIntervalBytes = 0;
+    int m_wavFd = -1;
+    int m_rawFd = -1;
+    uint64_t m_wavLength = 0;
+    uint64_t m_rawLength = 0;
+    CommitTarget m_wavCommit;
+    CommitTarget m_rawCommit;
+    int m_bytesPerSample = 1;
     std::string m_wavFileName = "";
     std::string m_rawFileName = "";
+    std::string m_shmName = "";
+    size_t m_shmSize = SHM_RING_DEFAULT_SIZE;
+    ShmRingWriter m_shmRing;
+    SeekIndexWriter m_rawIndex;
+    SeekIndexWriter m_wavIndex;
+    PeakPyramidWriter m_peaks;
 
     bool fileExists (const std::string& name) {
         std::ifstream f(name.c_str());
         return f.good();
     };
 
-    bool prepareFile(const std::string& fileName){
-        if(fileExists(fileName) && m_overwrite){
+    // no O_APPEND: the wav header is rewritten in place, data is appended at length
+    bool prepareFile(const std::string& fileName, int& fd, uint64_t& length){
+        bool exists = fileExists(fileName);
+        if(exists && m_overwrite){
             MSG_AND_RETURN_IF(std::remove(fileName.c_str()) != 0, false, "Can not remove existing file");
-            m_newCreated = true;
         }
-        int fd = open(fileName.c_str(), O_WRONLY | O_CREAT, 0644);
+        m_newCreated = !exists || m_overwrite;
+        fd = open(fileName.c_str(), O_WRONLY | O_CREAT, 0644);
         MSG_AND_RETURN_IF(fd < 0, false, "Failed to prepare file.");
-        (void)::close(fd);
+        struct stat st;
+        MSG_AND_RETURN_IF(fstat(fd, &st) < 0, false, "Can not stat %s", fileName.c_str());
+        length = st.st_size;
         return true;
     }
 
-    bool prepareWavHeader(const std::string& file, const HwConfig& streamInfo, int bytesPerSample){
-        if(!m_newCreated){
+    bool prepareIndex(SeekIndexWriter& index, const std::string& fileName, uint64_t dataOffset, const HwConfig& streamInfo, int bytesPerSample){
+        if(!m_seekIndex){
             return true;
         }
-        WAV_HEADER header;
-        header.channels = streamInfo.channels;
-        header.rate = streamInfo.rate;
-        header.bytes_per_sec = streamInfo.rate * bytesPerSample;
-        // TODO find out: not sure if I should devide by channels? (but 2 works for now) 
-        header.bits_per_sample = bytesPerSample * BITS_PER_BYTE / 2;
-        constexpr uint8_t STEREO = 4;
-        constexpr uint8_t MONO = 2;
-        header.block_alignment = streamInfo.channels > 1 ? STEREO : MONO;
-
-        u_char* buff = (u_char*)malloc(sizeof(header));
-        if(buff == nullptr){
-            return false;
-        }
+        uint64_t size = 0;
+        MSG_AND_RETURN_IF(!fileSize(fileName, size), false, "Can not stat %s", fileName.c_str());
+        uint64_t existingData = size > dataOffset ? size - dataOffset : 0;
+        return index.init(fileName + SEEK_INDEX_SUFFIX, dataOffset, existingData, streamInfo, bytesPerSample, m_seekIndexStride);
+    }
 
-        memcpy(buff, &header, sizeof(header));
-        bool res = internalWrite(file, buff, sizeof(header));
-        MSG_AND_RETURN_IF(!res, false, "failed creating wav header");
-        free(buff);
-        return res;
+    bool preparePeaks(const std::string& fileName, uint64_t dataOffset, const HwConfig& streamInfo, int bytesPerSample){
+        uint64_t size = 0;
+        MSG_AND_RETURN_IF(!fileSize(fileName, size), false, "Can not stat %s", fileName.c_str());
+        uint64_t existingFrames = size > dataOffset ? (size - dataOffset) / bytesPerSample : 0;
+        return m_peaks.init(fileName, streamInfo, bytesPerSample, m_peakBinFrames, dataOffset, existingFrames);
     }
 
-    bool internalWrite(const std::string& file, u_char* buff, size_t size){
-        std::ofstream ss;
-        ss.open(file, std::ios_base::app|std::ios::binary);
-        if(!ss.good()){
-            return false;
-        }
-        ss.write((char *)buff, size);
-        if(!ss.good()){
-            return false;
+    bool prepareWavHeader(const HwConfig& streamInfo, int bytesPerSample){
+        if(!m_newCreated){
+            return true;
         }
-        ss.close();
+        WAV_HEADER header = makeWavHeader(streamInfo, bytesPerSample);
+        m_wavLength = 0;
+        MSG_AND_RETURN_IF(!append(m_wavFd, m_wavLength, (const u_char*)&header, sizeof(header)), false, "failed creating wav header");
         return true;
     }
 
-    bool updateWavHeader(std::string file){
-        std::fstream ss;
-        ss.open(file, std::ios::in|std::ios::out|std::ios::binary);
-        if(!ss.good()){
-            return false;
+    bool append(int fd, uint64_t& length, const u_char* buff, size_t size){
+        size_t done = 0;
+        while(done < size){
+            ssize_t res = pwrite(fd, buff + done, size - done, length + done);
+            if(res < 0 && errno == EINTR){
+                continue;
+            }
+            MSG_AND_RETURN_IF(res <= 0, false, "pwrite failed: %s", strerror(errno));
+            done += res;
         }
-        ss.seekg(0, ss.end);
-        int fileLength = ss.tellg();
-        int chunkSize = fileLength - 8;
-        int dataSize = fileLength - sizeof(WAV_HEADER);
-        constexpr size_t POS_CHUNK_DATA_SIZE = 4;
-        constexpr size_t POS_SAMPLE_DATA_SIZE = 40;
-        ss.seekp(POS_CHUNK_DATA_SIZE, std::ios_base::beg);
-        setU32LEinStream(ss, (uint32_t)chunkSize);
-        ss.seekp(POS_SAMPLE_DATA_SIZE, std::ios_base::beg);
-        setU32LEinStream(ss, (uint32_t)dataSize);
-        ss.close();
+        length += size;
         return true;
     }
-
 };
 
 #endif
\ No newline at end of file
@@ -27,26 +27,58 @@ SOFTWARE.
 #include <cstdio>
 #include <string.h>
 
+#include "logger.hpp"
+
 #define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 
 #define BITS_PER_BYTE 8
 
-#define MSG_AND_RETURN_IF(cond, val, ...) do {  \
-    if(cond){                                   \
-        std::fprintf(stderr, __VA_ARGS__);      \
-        std::fprintf(stderr, "\n");             \
-        return val;                             \
-    }                                           \
-} while (false)
+#define LOG_AT(level, ...) Logger::instance().log(level, __FILENAME__, __func__, __LINE__, __VA_ARGS__)
 
-#define TR() do {                                                                       \
-    std::fprintf(stderr, "%s \t\t -> \t\t %s:%d \n", __FILENAME__, __func__, __LINE__);      \
-} while (false)
+#if ARECORD_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do { if(false) logDisabled(__VA_ARGS__); } while (false)
+#endif
+
+#if ARECORD_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do { if(false) logDisabled(__VA_ARGS__); } while (false)
+#endif
+
+#if ARECORD_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { if(false) logDisabled(__VA_ARGS__); } while (false)
+#endif
 
-#define TR_MSG(...) do {                                                                \
-    std::fprintf(stderr, "%s \t\t -> \t\t %s:%d \t ", __FILENAME__, __func__, __LINE__);     \
-    std::fprintf(stderr, __VA_ARGS__);                                                  \
-    std::fprintf(stderr, "\n");                                                         \
+#if ARECORD_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { if(false) logDisabled(__VA_ARGS__); } while (false)
+#endif
+
+#if ARECORD_LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) do { if(false) logDisabled(__VA_ARGS__); } while (false)
+#endif
+
+// log: one of the LOG_* macros, e.g. LOG_DEBUG for early returns that are no error
+#define LOG_AND_RETURN_IF(log, cond, val, ...) do {  \
+    if(cond){                                        \
+        log(__VA_ARGS__);                            \
+        return val;                                  \
+    }                                                \
 } while (false)
 
+#define MSG_AND_RETURN_IF(cond, val, ...) LOG_AND_RETURN_IF(LOG_ERROR, cond, val, __VA_ARGS__)
+
+// function entry trace
+#define TR() LOG_TRACE("%s", "")
+
+// debug output
+#define TR_MSG(...) LOG_DEBUG(__VA_ARGS__)
+
 #endif
\ No newline at end of file
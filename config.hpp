@@ -27,6 +27,23 @@ extern "C"{
 #include <alsa/asoundlib.h>
 }
 #include <string>
+#include <vector>
+
+/*
+ * Adaptive period sizing (capture). Between takes the period is renegotiated from what the
+ * previous take showed: xruns or a sink that needs too much of the period time double it,
+ * a stable take moves it a step towards target_latency_us (smaller periods for lower
+ * latency, larger ones for fewer wakeups). The buffer keeps buffer_periods periods.
+ */
+struct AdaptiveConfig{
+  bool enabled = false;
+  int min_period = 64;
+  int max_period = 8192;
+  unsigned int target_latency_us = 10000;
+  // fraction of the period time the sink may use per period before the period grows
+  double max_sink_load = 0.5;
+  unsigned int buffer_periods = 4;
+};
 
 struct HwConfig{
   std::string pcm_name = "default";
@@ -37,19 +54,85 @@ struct HwConfig{
   snd_pcm_stream_t stream = SND_PCM_STREAM_CAPTURE;
   // optional will be set internaly if -1
   int size_near = -1;
+  // optional, frames. Left to alsa if -1
+  int buffer_size_near = -1;
+  // sw params, optional. -1: avail_min = period, start_threshold = 1 (capture) or buffer (playback),
+  // stop_threshold = buffer
+  int avail_min = -1;
+  int start_threshold = -1;
+  int stop_threshold = -1;
+  AdaptiveConfig adaptive;
 };
 
 enum CAPTURE_MODE{
   STDOUT = 0x1,
   RAW    = 0x2,
-  WAV    = 0x4
+  WAV    = 0x4,
+  SHM    = 0x8
+};
+
+// when written capture data is forced to disk (fdatasync), see group_commit.hpp
+enum DURABILITY{
+  NONE     = 0,   // never, the wav header is written on close
+  PERIOD   = 1,   // every period, write blocks until it is on disk
+  INTERVAL = 2    // in the background, by sync_interval_ms and/or sync_interval_bytes
 };
 
 struct CaptureConfig{
   std::string raw_file_name = "";
   std::string wav_file_name = "";
+  // name of the posix shared memory object, must start with '/'
+  std::string shm_name = "";
+  size_t shm_size = 1 << 20;
   CAPTURE_MODE mode = CAPTURE_MODE::STDOUT;
   bool overwriteExistingFiles = true;
+  // write <file>.idx next to raw/wav files for random access, see seek_index.hpp
+  bool write_seek_index = false;
+  // frames per index entry, 0 = rate / 10
+  unsigned int seek_index_stride = 0;
+  // write a min/max/rms overview (<file>.peaks*) next to the wav, or raw file, see peak_pyramid.hpp
+  bool write_peaks = false;
+  // frames per bin of each overview level, each a multiple of the previous
+  std::vector<unsigned int> peak_bin_frames = {256, 4096, 65536};
+  DURABILITY durability = DURABILITY::INTERVAL;
+  // INTERVAL: longest time data stays unsynced, 0 = no limit
+  unsigned int sync_interval_ms = 1000;
+  // INTERVAL: most bytes per file left unsynced, 0 = no limit
+  size_t sync_interval_bytes = 0;
+};
+
+struct PlaybackConfig{
+  // wav files describe themselves, raw files are played with the HwConfig format/rate/channels
+  std::string file_name = "";
+  // periods read ahead of the playback thread, at least 2
+  size_t prefetch_periods = 8;
+  // map the file instead of reading it into prefetch buffers
+  bool mmap_file = false;
+};
+
+struct BatchJob{
+  // wav or raw, raw files are described by BatchConfig::raw_input
+  std::string input_file = "";
+  // empty: analysis only
+  std::string output_file = "";
+  // WAV or RAW, one output file per job
+  CAPTURE_MODE output_mode = CAPTURE_MODE::WAV;
+  // input channels to keep, in output order. Empty: all
+  std::vector<unsigned int> channels;
+  bool analyze = true;
+  bool write_seek_index = false;
+  // <output>.peaks*, as CaptureConfig::write_peaks
+  bool write_peaks = false;
+};
+
+struct BatchConfig{
+  // 0: one per core
+  unsigned int threads = 0;
+  // files are split into chunks of this many frames, processed in parallel
+  size_t chunk_frames = 1 << 20;
+  HwConfig raw_input;
+  // frames per bin of each peak level, as CaptureConfig::peak_bin_frames
+  std::vector<unsigned int> peak_bin_frames = {256, 4096, 65536};
 };
 
 /*
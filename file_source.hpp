@@ -0,0 +1,322 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _FILE_SOURCE_H_
+#define _FILE_SOURCE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.hpp"
+#include "config.hpp"
+
+// where the samples of a wav or raw file are and what they look like
+struct AudioFileInfo{
+    uint64_t dataOffset = 0;
+    uint64_t dataSize = 0;
+    unsigned int channels = 0;
+    unsigned int rate = 0;
+    snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+    bool wav = false;
+};
+
+inline uint32_t readU32LE(const uint8_t* p){
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline uint16_t readU16LE(const uint8_t* p){
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/*
+ * Inspect a file. Files starting with a RIFF/WAVE header are parsed (chunks are walked,
+ * so extra chunks before "data" are fine). Everything else is raw data described by rawInfo.
+ */
+inline bool probeAudioFile(int fd, const HwConfig& rawInfo, AudioFileInfo& info){
+    struct stat st;
+    MSG_AND_RETURN_IF(fstat(fd, &st) < 0, false, "Can not stat file");
+    const uint64_t fileSize = st.st_size;
+    uint8_t riff[12];
+    if(fileSize < sizeof(riff) || pread(fd, riff, sizeof(riff), 0) != sizeof(riff)
+       || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0){
+        info.dataOffset = 0;
+        info.dataSize = fileSize;
+        info.channels = rawInfo.channels;
+        info.rate = rawInfo.rate;
+        info.format = rawInfo.format;
+        info.wav = false;
+        return true;
+    }
+    info.wav = true;
+    bool haveFmt = false;
+    uint64_t pos = sizeof(riff);
+    while(pos + 8 <= fileSize){
+        uint8_t chunk[8];
+        MSG_AND_RETURN_IF(pread(fd, chunk, sizeof(chunk), pos) != sizeof(chunk), false, "Can not read wav chunk");
+        uint32_t chunkSize = readU32LE(chunk + 4);
+        if(memcmp(chunk, "fmt ", 4) == 0){
+            uint8_t fmt[16];
+            MSG_AND_RETURN_IF(chunkSize < sizeof(fmt), false, "wav fmt chunk too small");
+            MSG_AND_RETURN_IF(pread(fd, fmt, sizeof(fmt), pos + 8) != sizeof(fmt), false, "Can not read wav fmt chunk");
+            uint16_t audioFormat = readU16LE(fmt);
+            uint16_t bits = readU16LE(fmt + 14);
+            MSG_AND_RETURN_IF(audioFormat != 1, false, "Only PCM wav files supported, format %u", audioFormat);
+            info.channels = readU16LE(fmt + 2);
+            info.rate = readU32LE(fmt + 4);
+            info.format = bits == 8 ? SND_PCM_FORMAT_U8 : bits == 16 ? SND_PCM_FORMAT_S16_LE : SND_PCM_FORMAT_UNKNOWN;
+            MSG_AND_RETURN_IF(info.format == SND_PCM_FORMAT_UNKNOWN, false, "Unsupported bits per sample %u", bits);
+            haveFmt = true;
+        } else if(memcmp(chunk, "data", 4) == 0){
+            MSG_AND_RETURN_IF(!haveFmt, false, "wav data before fmt chunk");
+            info.dataOffset = pos + 8;
+            // header sizes of an interrupted recording are not trustworthy, the file length is
+            info.dataSize = fileSize - info.dataOffset;
+            if(chunkSize > 0 && chunkSize < info.dataSize){
+                info.dataSize = chunkSize;
+            }
+            return true;
+        }
+        pos += 8 + chunkSize + (chunkSize & 1);
+    }
+    LOG_ERROR("No data chunk in wav file");
+    return false;
+}
+
+/*
+ * Reads a file ahead of the consumer so that the consumer (the playback thread) never waits
+ * for disk I/O. In buffered mode a prefetch thread fills a ring of chunk sized buffers
+ * (at least two, i.e. double buffering). In mmap mode the file is mapped, chunks point into
+ * the mapping and the prefetch thread asks the kernel to read the next chunks ahead.
+ */
+class PrefetchReader{
+public:
+    PrefetchReader(){
+        TR_MSG("PrefetchReader");
+    };
+    ~PrefetchReader(){
+        close();
+    };
+
+    bool open(const std::string& fileName, const HwConfig& rawInfo){
+        TR();
+        close();
+        m_fd = ::open(fileName.c_str(), O_RDONLY);
+        MSG_AND_RETURN_IF(m_fd < 0, false, "Can not open %s", fileName.c_str());
+        MSG_AND_RETURN_IF(!probeAudioFile(m_fd, rawInfo, m_info), false, "Can not read %s", fileName.c_str());
+        (void)posix_fadvise(m_fd, m_info.dataOffset, m_info.dataSize, POSIX_FADV_SEQUENTIAL);
+        return true;
+    };
+
+    const AudioFileInfo& info() const {
+        return m_info;
+    };
+
+    // chunkSize: bytes handed out per next(), chunks: buffers read ahead
+    bool start(size_t chunkSize, size_t chunks, bool useMmap){
+        TR();
+        MSG_AND_RETURN_IF(m_fd < 0, false, "No file open");
+        MSG_AND_RETURN_IF(chunkSize == 0, false, "Invalid chunk size");
+        stopThread();
+        m_chunkSize = chunkSize;
+        m_chunks = std::max<size_t>(chunks, 2);
+        m_head = 0;
+        m_tail = 0;
+        m_readPos = 0;
+        m_eof = false;
+        m_error = false;
+        m_stop = false;
+        m_useMmap = useMmap;
+        if(m_useMmap && m_map == nullptr && m_info.dataSize > 0){
+            void* mem = mmap(nullptr, m_info.dataOffset + m_info.dataSize, PROT_READ, MAP_SHARED, m_fd, 0);
+            MSG_AND_RETURN_IF(mem == MAP_FAILED, false, "mmap failed");
+            m_map = static_cast<const uint8_t*>(mem);
+            m_mapSize = m_info.dataOffset + m_info.dataSize;
+            (void)madvise(const_cast<uint8_t*>(m_map), m_mapSize, MADV_SEQUENTIAL);
+        }
+        if(!m_useMmap){
+            m_buffers.resize(m_chunks);
+            m_sizes.assign(m_chunks, 0);
+            for(auto& buffer : m_buffers){
+                buffer.resize(m_chunkSize);
+            }
+        }
+        m_thread = std::thread(&PrefetchReader::prefetch, this);
+        return true;
+    };
+
+    /*
+     * Next chunk, blocks until it has been read. Returns false at end of file or on error.
+     * The chunk stays valid until release().
+     */
+    bool next(const uint8_t*& data, size_t& size){
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]{ return m_head != m_tail || m_eof || m_error; });
+        if(m_head == m_tail){
+            return false;
+        }
+        size_t slot = m_tail % m_chunks;
+        if(m_useMmap){
+            uint64_t offset = (uint64_t)m_tail * m_chunkSize;
+            data = m_map + m_info.dataOffset + offset;
+            size = std::min<uint64_t>(m_chunkSize, m_info.dataSize - offset);
+        } else {
+            data = m_buffers[slot].data();
+            size = m_sizes[slot];
+        }
+        return true;
+    };
+
+    void release(){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tail++;
+        }
+        m_cond.notify_all();
+    };
+
+    bool failed(){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_error;
+    };
+
+    void close(){
+        stopThread();
+        if(m_map){
+            (void)munmap(const_cast<uint8_t*>(m_map), m_mapSize);
+            m_map = nullptr;
+        }
+        if(m_fd >= 0){
+            (void)::close(m_fd);
+            m_fd = -1;
+        }
+    };
+
+private:
+    int m_fd = -1;
+    AudioFileInfo m_info;
+    const uint8_t* m_map = nullptr;
+    size_t m_mapSize = 0;
+    bool m_useMmap = false;
+    size_t m_chunkSize = 0;
+    size_t m_chunks = 2;
+    std::vector<std::vector<uint8_t>> m_buffers;
+    std::vector<size_t> m_sizes;
+    // chunk counters, produced: m_head, consumed: m_tail
+    uint64_t m_head = 0;
+    uint64_t m_tail = 0;
+    uint64_t m_readPos = 0;
+    bool m_eof = false;
+    bool m_error = false;
+    bool m_stop = false;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::thread m_thread;
+
+    void stopThread(){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        if(m_thread.joinable()){
+            m_thread.join();
+        }
+    };
+
+    void prefetch(){
+        while(true){
+            uint64_t head;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [this]{ return m_stop || m_head - m_tail < m_chunks; });
+                if(m_stop){
+                    return;
+                }
+                head = m_head;
+            }
+            uint64_t remaining = m_info.dataSize - m_readPos;
+            size_t size = std::min<uint64_t>(m_chunkSize, remaining);
+            bool ok = true;
+            if(size > 0){
+                ok = m_useMmap ? touch(m_readPos, size) : readChunk(head % m_chunks, size);
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if(!ok){
+                    m_error = true;
+                } else if(size == 0){
+                    m_eof = true;
+                } else {
+                    m_readPos += size;
+                    m_head++;
+                }
+            }
+            m_cond.notify_all();
+            if(!ok || size == 0){
+                return;
+            }
+        }
+    };
+
+    bool readChunk(size_t slot, size_t size){
+        uint8_t* dst = m_buffers[slot].data();
+        size_t done = 0;
+        while(done < size){
+            ssize_t res = pread(m_fd, dst + done, size - done, m_info.dataOffset + m_readPos + done);
+            if(res < 0 && errno == EINTR){
+                continue;
+            }
+            MSG_AND_RETURN_IF(res <= 0, false, "Read from file failed");
+            done += res;
+        }
+        m_sizes[slot] = size;
+        return true;
+    };
+
+    // fault the chunk in here, not in the playback thread
+    bool touch(uint64_t pos, size_t size){
+        const uint8_t* p = m_map + m_info.dataOffset + pos;
+        const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)p & ~(uintptr_t)(pageSize - 1);
+        (void)madvise(reinterpret_cast<void*>(start), size + ((uintptr_t)p - start), MADV_WILLNEED);
+        volatile uint8_t sink = 0;
+        for(size_t off = 0; off < size; off += pageSize){
+            sink = sink + p[off];
+        }
+        (void)sink;
+        return true;
+    };
+};
+
+#endif
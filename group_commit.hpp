@@ -0,0 +1,367 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _GROUP_COMMIT_H_
+#define _GROUP_COMMIT_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "config.hpp"
+
+class GroupCommitter;
+
+/*
+ * A file appended to by one writer whose data the GroupCommitter makes durable according
+ * to a DURABILITY policy. The optional header writer is called with the length that was
+ * just synced, so a header never describes more data than survives a crash. The header
+ * write itself becomes durable with the next commit.
+ */
+class CommitTarget{
+public:
+    using HeaderWriter = std::function<bool(int fd, uint64_t length)>;
+
+    CommitTarget(){
+        TR_MSG("CommitTarget");
+    };
+    ~CommitTarget(){
+        close();
+    };
+
+    // fd stays owned by the caller; length: current file length
+    bool init(int fd, uint64_t length, DURABILITY policy, unsigned int intervalMs, size_t intervalBytes,
+              HeaderWriter header = HeaderWriter());
+
+    // data was appended, the file is length bytes long now. Does not block
+    void written(uint64_t length);
+
+    // DURABILITY::PERIOD: block until everything passed to written() is synced
+    bool waitSynced();
+
+    // unregister, sync (unless DURABILITY::NONE) and write the final header
+    bool close();
+
+    uint64_t getSyncedLength() const {
+        return m_syncedLength.load(std::memory_order_acquire);
+    };
+
+    // the last commit failed; it is retried, see GroupCommitter
+    bool failed() const {
+        return m_failed.load(std::memory_order_acquire);
+    };
+
+private:
+    friend class GroupCommitter;
+
+    int m_fd = -1;
+    DURABILITY m_policy = DURABILITY::NONE;
+    uint64_t m_intervalNs = 0;
+    uint64_t m_intervalBytes = 0;
+    HeaderWriter m_header;
+    std::atomic<uint64_t> m_length{0};
+    std::atomic<uint64_t> m_syncedLength{0};
+    std::atomic<bool> m_nudged{false};      // bytes limit reported since the last commit
+    std::atomic<bool> m_dirty{false};       // data reported since the last commit
+    std::atomic<bool> m_failed{false};
+    // guarded by the committer mutex
+    uint64_t m_requested = 0;
+    uint64_t m_lastCommitNs = 0;
+    bool m_registered = false;
+
+    // committer thread, without lock
+    bool commit(uint64_t length){
+        // retries of a failed target only log when it failed for the first time
+        bool quiet = m_failed.load(std::memory_order_relaxed);
+        if(fdatasync(m_fd) < 0){
+            if(!quiet){
+                LOG_ERROR("fdatasync failed: %s", strerror(errno));
+            }
+            return false;
+        }
+        if(m_header && !m_header(m_fd, length)){
+            if(!quiet){
+                LOG_ERROR("Failed to write header");
+            }
+            return false;
+        }
+        return true;
+    };
+};
+
+/*
+ * One background thread doing the fdatasync calls of all open CommitTargets. A target is
+ * due when a PERIOD writer waits for it or its interval (time or bytes) is over. Dirty
+ * targets half way through their interval are committed in the same pass, so sinks
+ * written together (wav + raw, several recorders) share wake ups, and PERIOD writers
+ * arriving during a pass share the next one. A failed target is retried after its interval,
+ * at least RETRY_NS, until a commit succeeds again.
+ */
+class GroupCommitter{
+public:
+    static GroupCommitter& instance(){
+        static GroupCommitter committer;
+        return committer;
+    };
+
+    // passes and fdatasync calls so far
+    uint64_t getCommits() const {
+        return m_commits.load(std::memory_order_relaxed);
+    };
+
+    uint64_t getSyncs() const {
+        return m_syncs.load(std::memory_order_relaxed);
+    };
+
+private:
+    friend class CommitTarget;
+
+    static constexpr uint64_t RETRY_NS = 100000000ull;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work;     // committer waits for requests
+    std::condition_variable m_done;     // writers wait for passes
+    std::vector<CommitTarget*> m_targets;
+    bool m_busy = false;
+    bool m_stop = false;
+    std::atomic<uint64_t> m_commits{0};
+    std::atomic<uint64_t> m_syncs{0};
+    std::thread m_thread;
+
+    GroupCommitter(){
+        m_thread = std::thread(&GroupCommitter::run, this);
+    };
+
+    ~GroupCommitter(){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_work.notify_all();
+        if(m_thread.joinable()){
+            m_thread.join();
+        }
+    };
+
+    static uint64_t nowNs(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    };
+
+    void add(CommitTarget* target){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        target->m_lastCommitNs = nowNs();
+        m_targets.push_back(target);
+        m_work.notify_one();
+    };
+
+    // waits for a running pass, it may use the target
+    void remove(CommitTarget* target){
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [&]{ return !m_busy; });
+        m_targets.erase(std::remove(m_targets.begin(), m_targets.end(), target), m_targets.end());
+        m_done.notify_all();
+    };
+
+    void nudge(){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_work.notify_one();
+    };
+
+    void request(CommitTarget* target, uint64_t length){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        target->m_requested = std::max(target->m_requested, length);
+        m_work.notify_one();
+    };
+
+    bool wait(CommitTarget* target, uint64_t length){
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [&]{
+            return m_stop || target->m_failed || target->m_syncedLength.load(std::memory_order_relaxed) >= length;
+        });
+        return target->m_syncedLength.load(std::memory_order_relaxed) >= length;
+    };
+
+    // 0: commit now, otherwise ns until the target is due (UINT64_MAX: never)
+    uint64_t dueIn(const CommitTarget* target, uint64_t now, uint64_t length, bool piggyback) const {
+        uint64_t synced = target->m_syncedLength.load(std::memory_order_relaxed);
+        if(length <= synced){
+            return UINT64_MAX;
+        }
+        if(target->m_failed.load(std::memory_order_relaxed)){
+            // no busy retry loop on a broken disk, whatever the policy asks for
+            uint64_t retry = std::max(target->m_intervalNs, RETRY_NS);
+            uint64_t elapsed = now - target->m_lastCommitNs;
+            return elapsed >= retry ? 0 : retry - elapsed;
+        }
+        if(target->m_requested > synced){
+            return 0;
+        }
+        if(target->m_intervalBytes > 0 && length - synced >= target->m_intervalBytes){
+            return 0;
+        }
+        if(target->m_intervalNs == 0){
+            return UINT64_MAX;
+        }
+        uint64_t interval = piggyback ? target->m_intervalNs / 2 : target->m_intervalNs;
+        uint64_t elapsed = now - target->m_lastCommitNs;
+        return elapsed >= interval ? 0 : target->m_intervalNs - elapsed;
+    };
+
+    void run(){
+        struct Due{
+            CommitTarget* target;
+            uint64_t length;
+        };
+        std::vector<Due> due;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while(!m_stop){
+            uint64_t now = nowNs();
+            uint64_t next = UINT64_MAX;
+            bool any = false;
+            for(auto target : m_targets){
+                uint64_t in = dueIn(target, now, target->m_length.load(std::memory_order_acquire), false);
+                any |= in == 0;
+                next = std::min(next, in);
+            }
+            if(!any){
+                if(next == UINT64_MAX){
+                    m_work.wait(lock);
+                } else {
+                    m_work.wait_for(lock, std::chrono::nanoseconds(next));
+                }
+                continue;
+            }
+            due.clear();
+            for(auto target : m_targets){
+                uint64_t length = target->m_length.load(std::memory_order_acquire);
+                if(dueIn(target, now, length, true) == 0){
+                    due.push_back({target, length});
+                }
+            }
+            m_busy = true;
+            lock.unlock();
+            // data written before length was published is covered by the sync
+            std::vector<bool> ok(due.size());
+            for(size_t i = 0; i < due.size(); i++){
+                ok[i] = due[i].target->commit(due[i].length);
+            }
+            m_commits.fetch_add(1, std::memory_order_relaxed);
+            m_syncs.fetch_add(due.size(), std::memory_order_relaxed);
+            lock.lock();
+            now = nowNs();
+            for(size_t i = 0; i < due.size(); i++){
+                CommitTarget* target = due[i].target;
+                target->m_lastCommitNs = now;
+                if(ok[i] && target->m_failed.load(std::memory_order_relaxed)){
+                    LOG_INFO("Sync works again");
+                }
+                target->m_failed.store(!ok[i], std::memory_order_release);
+                if(ok[i]){
+                    target->m_syncedLength.store(due[i].length, std::memory_order_release);
+                }
+                target->m_nudged.store(false, std::memory_order_relaxed);
+                // seq_cst: a writer either sees this or the loop below sees its length
+                target->m_dirty.store(false, std::memory_order_seq_cst);
+            }
+            m_busy = false;
+            m_done.notify_all();
+        }
+        m_done.notify_all();
+    };
+};
+
+inline bool CommitTarget::init(int fd, uint64_t length, DURABILITY policy, unsigned int intervalMs, size_t intervalBytes,
+                               HeaderWriter header){
+    TR();
+    LOG_AND_RETURN_IF(LOG_DEBUG, m_registered, true, "Already initialized");
+    MSG_AND_RETURN_IF(fd < 0, false, "Invalid file descriptor");
+    m_fd = fd;
+    m_policy = policy;
+    m_intervalNs = (uint64_t)intervalMs * 1000000ull;
+    m_intervalBytes = intervalBytes;
+    m_header = header;
+    m_length.store(length, std::memory_order_release);
+    // what is there already counts as synced, it was written by an earlier run
+    m_syncedLength.store(length, std::memory_order_release);
+    m_failed.store(false, std::memory_order_relaxed);
+    if(m_policy != DURABILITY::NONE){
+        GroupCommitter::instance().add(this);
+    }
+    m_registered = true;
+    return true;
+}
+
+inline void CommitTarget::written(uint64_t length){
+    m_length.store(length, std::memory_order_seq_cst);
+    if(m_policy == DURABILITY::PERIOD){
+        GroupCommitter::instance().request(this, length);
+    } else if(m_policy == DURABILITY::INTERVAL){
+        // the committer sleeps without a deadline while all targets are clean: wake it on
+        // the first write after a commit so it arms the interval, and at the bytes limit
+        bool first = !m_dirty.exchange(true, std::memory_order_seq_cst);
+        bool full = m_intervalBytes > 0 && length - m_syncedLength.load(std::memory_order_acquire) >= m_intervalBytes
+                    && !m_nudged.exchange(true, std::memory_order_relaxed);
+        if(first || full){
+            GroupCommitter::instance().nudge();
+        }
+    }
+}
+
+inline bool CommitTarget::waitSynced(){
+    if(m_policy != DURABILITY::PERIOD || !m_registered){
+        return true;
+    }
+    return GroupCommitter::instance().wait(this, m_length.load(std::memory_order_relaxed));
+}
+
+inline bool CommitTarget::close(){
+    if(!m_registered){
+        return true;
+    }
+    m_registered = false;
+    uint64_t length = m_length.load(std::memory_order_acquire);
+    if(m_policy == DURABILITY::NONE){
+        return !m_header || m_header(m_fd, length);
+    }
+    GroupCommitter::instance().remove(this);
+    // data, then the header describing it, then the header itself
+    bool ok = commit(length);
+    ok = ok && fdatasync(m_fd) == 0;
+    m_syncedLength.store(length, std::memory_order_release);
+    return ok;
+}
+
+#endif
@@ -36,8 +36,8 @@ public:
         TR_MSG("Handle");
     };
     ~Handle(){
-        snd_pcm_drain(m_handle);
         if(m_handle){
+            snd_pcm_drain(m_handle);
             snd_pcm_close(m_handle);
         }
     };
@@ -57,7 +57,7 @@ public:
     };
 
 private:
-    snd_pcm_t *m_handle;
+    snd_pcm_t *m_handle = nullptr;
 };
 
 #endif
\ No newline at end of file
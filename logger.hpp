@@ -0,0 +1,216 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdarg>
+#include <cstdio>
+#include <thread>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL_TRACE 5
+
+// levels above this are not compiled in at all
+#ifndef ARECORD_LOG_LEVEL
+#define ARECORD_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/*
+ * Asynchronous logger. The calling thread only formats the message into a slot of a
+ * bounded lock free queue (multi producer, single consumer); a background thread adds
+ * the prefix and writes to stderr. If the queue is full the message is dropped and
+ * counted, so a slow or blocked stderr never blocks the caller (e.g. the capture thread).
+ */
+class Logger{
+public:
+    static Logger& instance(){
+        static Logger logger;
+        return logger;
+    };
+
+    __attribute__((format(printf, 6, 7)))
+    void log(int level, const char* file, const char* func, int line, const char* fmt, ...){
+        uint64_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        while(true){
+            slot = &m_slots[pos % QUEUE_SIZE];
+            uint64_t seq = slot->sequence.load(std::memory_order_acquire);
+            int64_t diff = (int64_t)seq - (int64_t)pos;
+            if(diff == 0){
+                if(m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    break;
+                }
+            } else if(diff < 0){
+                // full, the consumer is behind
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->level = level;
+        slot->file = file;
+        slot->func = func;
+        slot->line = line;
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(slot->msg, sizeof(slot->msg), fmt, args);
+        va_end(args);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+
+        m_pending.fetch_add(1, std::memory_order_seq_cst);
+        if(m_sleeping.load(std::memory_order_seq_cst)){
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_pending), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        }
+    };
+
+    // messages lost because the queue was full
+    uint64_t getDropped() const {
+        return m_dropped.load(std::memory_order_relaxed);
+    };
+
+    // wait until everything queued so far is written
+    void flush(){
+        uint64_t target = m_enqueuePos.load(std::memory_order_acquire);
+        while(m_dequeuePos.load(std::memory_order_acquire) < target && m_running.load()){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        fflush(stderr);
+    };
+
+private:
+    static constexpr size_t QUEUE_SIZE = 1024;  // power of two
+    static constexpr size_t MSG_SIZE = 240;
+
+    struct Slot{
+        std::atomic<uint64_t> sequence{0};
+        int level = 0;
+        const char* file = nullptr;
+        const char* func = nullptr;
+        int line = 0;
+        char msg[MSG_SIZE];
+    };
+
+    Slot m_slots[QUEUE_SIZE];
+    alignas(64) std::atomic<uint64_t> m_enqueuePos{0};
+    alignas(64) std::atomic<uint64_t> m_dequeuePos{0};
+    std::atomic<uint32_t> m_pending{0};
+    std::atomic<uint32_t> m_sleeping{0};
+    std::atomic<uint64_t> m_dropped{0};
+    uint64_t m_droppedReported = 0;     // consumer thread only
+    std::atomic<bool> m_running{true};
+    std::thread m_thread;
+
+    Logger(){
+        for(size_t i = 0; i < QUEUE_SIZE; i++){
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        m_thread = std::thread(&Logger::run, this);
+    };
+
+    ~Logger(){
+        m_running = false;
+        m_pending.fetch_add(1);
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_pending), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        if(m_thread.joinable()){
+            m_thread.join();
+        }
+    };
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    static const char* levelName(int level){
+        switch(level){
+            case LOG_LEVEL_ERROR: return "E";
+            case LOG_LEVEL_WARN:  return "W";
+            case LOG_LEVEL_INFO:  return "I";
+            case LOG_LEVEL_DEBUG: return "D";
+            default:              return "T";
+        }
+    };
+
+    // write everything that is ready, returns false if nothing was
+    bool drain(){
+        bool any = false;
+        while(true){
+            uint64_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+            Slot& slot = m_slots[pos % QUEUE_SIZE];
+            if(slot.sequence.load(std::memory_order_acquire) != pos + 1){
+                break;
+            }
+            std::fprintf(stderr, "[%s] %s \t\t -> \t\t %s:%d \t %s\n", levelName(slot.level), slot.file, slot.func, slot.line, slot.msg);
+            slot.sequence.store(pos + QUEUE_SIZE, std::memory_order_release);
+            m_dequeuePos.store(pos + 1, std::memory_order_release);
+            any = true;
+        }
+        // m_dropped stays a running total for getDropped(), only the new ones are reported
+        uint64_t total = m_dropped.load(std::memory_order_relaxed);
+        uint64_t dropped = total - m_droppedReported;
+        m_droppedReported = total;
+        if(dropped > 0){
+            std::fprintf(stderr, "[W] logger \t\t -> \t\t %lu messages dropped\n", (unsigned long)dropped);
+        }
+        if(any){
+            fflush(stderr);
+        }
+        return any;
+    };
+
+    void run(){
+        while(true){
+            uint32_t pending = m_pending.load(std::memory_order_seq_cst);
+            if(drain()){
+                continue;
+            }
+            if(!m_running.load()){
+                break;
+            }
+            m_sleeping.store(1, std::memory_order_seq_cst);
+            // a producer that published after the drain changed m_pending, no wait then
+            struct timespec timeout = {0, 100 * 1000000L};
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_pending), FUTEX_WAIT_PRIVATE, pending, &timeout, nullptr, 0);
+            m_sleeping.store(0, std::memory_order_seq_cst);
+        }
+        drain();
+    };
+};
+
+// keeps format checking and "used" arguments for levels that are compiled out
+__attribute__((format(printf, 1, 2)))
+inline void logDisabled(const char*, ...){}
+
+#endif
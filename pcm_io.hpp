@@ -0,0 +1,106 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _PCM_IO_H_
+#define _PCM_IO_H_
+
+extern "C"{
+#include <alsa/asoundlib.h>
+}
+
+#include <atomic>
+#include <stdint.h>
+
+#include "common.hpp"
+
+// instrumentation shared by capture and playback
+struct XrunStats{
+    std::atomic<uint64_t> frames{0};    // frames transferred
+    std::atomic<uint64_t> xruns{0};     // overruns (capture) or underruns (playback)
+
+    void reset(){
+        frames = 0;
+        xruns = 0;
+    };
+};
+
+inline bool isMmapAccess(snd_pcm_access_t access){
+    return access == SND_PCM_ACCESS_MMAP_INTERLEAVED
+        || access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED
+        || access == SND_PCM_ACCESS_MMAP_COMPLEX;
+}
+
+/*
+ * Read exactly samplesToRead frames. Overruns are counted, the pcm is prepared again
+ * and reading continues; xrun tells the caller that frames were lost in between.
+ */
+inline bool readFromPcm(snd_pcm_t* handle, bool mmapAccess, u_char* buff, snd_pcm_uframes_t samplesToRead,
+                        int bytesPerSample, size_t &read, XrunStats& stats, bool& xrun){
+    size_t readCountTotal = 0;
+    while(readCountTotal < samplesToRead) {
+        snd_pcm_uframes_t toRead = samplesToRead - readCountTotal;
+        u_char* dst = buff + readCountTotal * bytesPerSample;
+        ssize_t readCount = mmapAccess ? snd_pcm_mmap_readi(handle, dst, toRead) : snd_pcm_readi(handle, dst, toRead);
+        if (readCount == -EPIPE) {
+            LOG_WARN("pipe overrun occurred");
+            stats.xruns++;
+            xrun = true;
+            snd_pcm_prepare(handle);
+            continue;
+        }
+        if(readCount < 0){
+            LOG_ERROR("General Error. Abort");
+            return false;
+        }
+        readCountTotal += readCount;
+    }
+    stats.frames += readCountTotal;
+    read = readCountTotal * bytesPerSample ;
+    return true;
+}
+
+// Write exactly samplesToWrite frames. Underruns are counted and the pcm is prepared again.
+inline bool writeToPcm(snd_pcm_t* handle, bool mmapAccess, const u_char* buff, snd_pcm_uframes_t samplesToWrite,
+                       int bytesPerSample, XrunStats& stats){
+    size_t writeCountTotal = 0;
+    while(writeCountTotal < samplesToWrite) {
+        snd_pcm_uframes_t toWrite = samplesToWrite - writeCountTotal;
+        const u_char* src = buff + writeCountTotal * bytesPerSample;
+        ssize_t writeCount = mmapAccess ? snd_pcm_mmap_writei(handle, src, toWrite) : snd_pcm_writei(handle, src, toWrite);
+        if (writeCount == -EPIPE) {
+            LOG_WARN("pipe underrun occurred");
+            stats.xruns++;
+            snd_pcm_prepare(handle);
+            continue;
+        }
+        if(writeCount < 0){
+            LOG_ERROR("General Error. Abort");
+            return false;
+        }
+        writeCountTotal += writeCount;
+    }
+    stats.frames += writeCountTotal;
+    return true;
+}
+
+#endif
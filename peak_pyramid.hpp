@@ -0,0 +1,536 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _PEAK_PYRAMID_H_
+#define _PEAK_PYRAMID_H_
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "common.hpp"
+#include "config.hpp"
+
+/*
+ * Min/max/rms overview of a recording in several resolutions, built while capturing.
+ *
+ *   <recording>.peaks     PeakPyramidHeader: stream info and frames per bin of every level
+ *   <recording>.peaks.N   bins of level N: [bin][channel] PeakBin, appended as bins complete
+ *
+ * Values are scaled to signed 16 bit whatever the sample format. Every level is a flat
+ * array, so rendering a range touches only the bins of that range in one level.
+ */
+constexpr uint32_t PEAK_PYRAMID_MAGIC = 0x4b505241; // "ARPK"
+constexpr uint32_t PEAK_PYRAMID_VERSION = 1;
+constexpr size_t PEAK_PYRAMID_MAX_LEVELS = 8;
+const std::string PEAK_PYRAMID_SUFFIX = ".peaks";
+
+struct PeakPyramidHeader{
+  uint32_t magic = PEAK_PYRAMID_MAGIC;
+  uint32_t version = PEAK_PYRAMID_VERSION;
+  uint32_t channels = 0;
+  uint32_t rate = 0;
+  int32_t format = SND_PCM_FORMAT_UNKNOWN;
+  uint32_t level_count = 0;
+  uint32_t bin_frames[PEAK_PYRAMID_MAX_LEVELS] = {0};
+  uint8_t reserved[8] = {0};
+};
+static_assert(sizeof(PeakPyramidHeader) == 64, "peak header is part of the file format");
+
+struct PeakBin{
+  int16_t min = 0;
+  int16_t max = 0;
+  uint16_t rms = 0;
+};
+static_assert(sizeof(PeakBin) == 6, "peak bin is part of the file format");
+
+inline std::string peakLevelFileName(const std::string& recording, size_t level){
+    return recording + PEAK_PYRAMID_SUFFIX + "." + std::to_string(level);
+}
+
+// running min/max/sum of squares of one channel
+struct PeakAccumulator{
+    int32_t min = INT16_MAX;
+    int32_t max = INT16_MIN;
+    uint64_t sumSquares = 0;
+
+    void reset(){
+        min = INT16_MAX;
+        max = INT16_MIN;
+        sumSquares = 0;
+    };
+
+    void merge(const PeakAccumulator& other){
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        sumSquares += other.sumSquares;
+    };
+
+    PeakBin toBin(uint64_t frames) const {
+        PeakBin bin;
+        bin.min = (int16_t)min;
+        bin.max = (int16_t)max;
+        double rms = frames > 0 ? std::sqrt((double)sumSquares / frames) : 0.0;
+        bin.rms = (uint16_t)std::min(rms + 0.5, 65535.0);
+        return bin;
+    };
+};
+
+/*
+ * Reduce frames of interleaved S16 samples into one accumulator per channel.
+ * The SSE2 path keeps 8 samples per register; with 1, 2, 4 or 8 channels lane i always
+ * holds channel i % channels, so lanes are only folded into channels at the end.
+ */
+inline void reduceS16(const int16_t* samples, size_t frames, unsigned int channels, PeakAccumulator* acc){
+    size_t total = frames * channels;
+    size_t i = 0;
+#if defined(__SSE2__)
+    if(channels <= 8 && 8 % channels == 0 && total >= 8){
+        __m128i vmin = _mm_set1_epi16(INT16_MAX);
+        __m128i vmax = _mm_set1_epi16(INT16_MIN);
+        const __m128i evenMask = _mm_set1_epi32(0x0000FFFF);
+        const __m128i oddMask = _mm_set1_epi32((int)0xFFFF0000);
+        const __m128i zero = _mm_setzero_si128();
+        // 64 bit sums of squares of lanes 0,2 | 4,6 | 1,3 | 5,7
+        __m128i sumEvenLo = zero, sumEvenHi = zero, sumOddLo = zero, sumOddHi = zero;
+        for(; i + 8 <= total; i += 8){
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+            vmin = _mm_min_epi16(vmin, v);
+            vmax = _mm_max_epi16(vmax, v);
+            // masking one sample of each pair: madd gives single squares (<= 2^30) per 32 bit lane
+            __m128i sqEven = _mm_madd_epi16(_mm_and_si128(v, evenMask), v);
+            __m128i sqOdd = _mm_madd_epi16(_mm_and_si128(v, oddMask), v);
+            sumEvenLo = _mm_add_epi64(sumEvenLo, _mm_unpacklo_epi32(sqEven, zero));
+            sumEvenHi = _mm_add_epi64(sumEvenHi, _mm_unpackhi_epi32(sqEven, zero));
+            sumOddLo = _mm_add_epi64(sumOddLo, _mm_unpacklo_epi32(sqOdd, zero));
+            sumOddHi = _mm_add_epi64(sumOddHi, _mm_unpackhi_epi32(sqOdd, zero));
+        }
+        int16_t mins[8], maxs[8];
+        uint64_t evenLo[2], evenHi[2], oddLo[2], oddHi[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(mins), vmin);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(maxs), vmax);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(evenLo), sumEvenLo);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(evenHi), sumEvenHi);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(oddLo), sumOddLo);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(oddHi), sumOddHi);
+        const uint64_t squares[8] = {evenLo[0], oddLo[0], evenLo[1], oddLo[1], evenHi[0], oddHi[0], evenHi[1], oddHi[1]};
+        for(unsigned int lane = 0; lane < 8; lane++){
+            PeakAccumulator& a = acc[lane % channels];
+            a.min = std::min<int32_t>(a.min, mins[lane]);
+            a.max = std::max<int32_t>(a.max, maxs[lane]);
+            a.sumSquares += squares[lane];
+        }
+    }
+#endif
+    // remainder, and channel counts the vector path does not cover. i is frame aligned here
+    for(; i < total; i += channels){
+        for(unsigned int c = 0; c < channels; c++){
+            int32_t v = samples[i + c];
+            PeakAccumulator& a = acc[c];
+            a.min = std::min(a.min, v);
+            a.max = std::max(a.max, v);
+            a.sumSquares += (uint64_t)(v * v);
+        }
+    }
+}
+
+// other formats: scale to signed 16 bit first
+inline int16_t sampleToS16(snd_pcm_format_t format, const uint8_t* p){
+    switch(format){
+        case SND_PCM_FORMAT_S8:     return (int16_t)((int8_t)p[0] * 256);
+        case SND_PCM_FORMAT_U8:     return (int16_t)(((int32_t)p[0] - 0x80) * 256);
+        case SND_PCM_FORMAT_S16_LE: return (int16_t)(p[0] | (p[1] << 8));
+        case SND_PCM_FORMAT_S16_BE: return (int16_t)((p[0] << 8) | p[1]);
+        case SND_PCM_FORMAT_U16_LE: return (int16_t)((int32_t)(p[0] | (p[1] << 8)) - 0x8000);
+        case SND_PCM_FORMAT_U16_BE: return (int16_t)((int32_t)((p[0] << 8) | p[1]) - 0x8000);
+        case SND_PCM_FORMAT_S24_3LE: return (int16_t)(p[1] | (p[2] << 8));
+        case SND_PCM_FORMAT_S24_LE: return (int16_t)(p[1] | (p[2] << 8));
+        case SND_PCM_FORMAT_S32_LE: return (int16_t)(p[2] | (p[3] << 8));
+        case SND_PCM_FORMAT_S32_BE: return (int16_t)((p[0] << 8) | p[1]);
+        case SND_PCM_FORMAT_FLOAT_LE: {
+            float f;
+            memcpy(&f, p, sizeof(f));
+            return (int16_t)std::max(-32768.0f, std::min(32767.0f, f * 32768.0f));
+        }
+        default:                    return 0;
+    }
+}
+
+class PeakPyramidWriter{
+public:
+    PeakPyramidWriter(){
+        TR_MSG("PeakPyramidWriter");
+    };
+    ~PeakPyramidWriter(){
+        close();
+    };
+
+    /*
+     * bytesPerSample: bytes of one frame (all channels).
+     * binFrames: frames per bin of each level, ascending, each a multiple of the previous.
+     * existingFrames: frames already in the recording (appending). They are (re)read from
+     * the recording at dataOffset as far as the existing peaks do not cover them.
+     */
+    bool init(const std::string& recording, const HwConfig& streamInfo, int bytesPerSample,
+              const std::vector<unsigned int>& binFrames, uint64_t dataOffset = 0, uint64_t existingFrames = 0){
+        TR();
+        LOG_AND_RETURN_IF(LOG_DEBUG, !m_levels.empty(), true, "Already initialized");
+        MSG_AND_RETURN_IF(binFrames.empty() || binFrames.size() > PEAK_PYRAMID_MAX_LEVELS, false, "Invalid number of peak levels %zu", binFrames.size());
+        MSG_AND_RETURN_IF(streamInfo.channels == 0 || bytesPerSample <= 0, false, "Invalid stream");
+        for(size_t i = 0; i < binFrames.size(); i++){
+            MSG_AND_RETURN_IF(binFrames[i] == 0 || (i > 0 && binFrames[i] % binFrames[i - 1] != 0), false, "Peak bin size %u must be a multiple of the previous level", binFrames[i]);
+        }
+        m_header.channels = streamInfo.channels;
+        m_header.rate = streamInfo.rate;
+        m_header.format = streamInfo.format;
+        m_header.level_count = binFrames.size();
+        std::copy(binFrames.begin(), binFrames.end(), m_header.bin_frames);
+        m_format = streamInfo.format;
+        m_bytesPerSample = bytesPerSample;
+        m_channels = streamInfo.channels;
+        m_level0.assign(m_channels, PeakAccumulator());
+        m_converted.resize(CONVERT_FRAMES * m_channels);
+
+        uint64_t covered = coveredFrames(recording, existingFrames);
+        std::string headerFile = recording + PEAK_PYRAMID_SUFFIX;
+        int fd = open(headerFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        MSG_AND_RETURN_IF(fd < 0, false, "Can not create %s", headerFile.c_str());
+        bool ok = pwrite(fd, &m_header, sizeof(m_header), 0) == sizeof(m_header);
+        (void)::close(fd);
+        MSG_AND_RETURN_IF(!ok, false, "Can not write %s", headerFile.c_str());
+
+        m_levels.resize(binFrames.size());
+        for(size_t i = 0; i < m_levels.size(); i++){
+            Level& level = m_levels[i];
+            level.binFrames = binFrames[i];
+            level.acc.assign(m_channels, PeakAccumulator());
+            std::string file = peakLevelFileName(recording, i);
+            level.fd = open(file.c_str(), O_WRONLY | O_CREAT, 0644);
+            MSG_AND_RETURN_IF(level.fd < 0, false, "Can not open %s", file.c_str());
+            // drop bins past what is covered, they are rebuilt from the recording below
+            uint64_t bins = covered / level.binFrames;
+            MSG_AND_RETURN_IF(ftruncate(level.fd, bins * m_channels * sizeof(PeakBin)) < 0, false, "Can not truncate %s", file.c_str());
+            MSG_AND_RETURN_IF(lseek(level.fd, 0, SEEK_END) < 0, false, "Can not seek %s", file.c_str());
+        }
+        m_frames = covered;
+        if(existingFrames > covered){
+            MSG_AND_RETURN_IF(!replay(recording, dataOffset, covered, existingFrames), false, "Can not read existing frames of %s", recording.c_str());
+        }
+        return true;
+    };
+
+    // interleaved frames in the stream format
+    void add(const uint8_t* data, size_t frames){
+        if(m_levels.empty()){
+            return;
+        }
+        const unsigned int binFrames = m_levels[0].binFrames;
+        while(frames > 0){
+            size_t run = std::min<size_t>(frames, binFrames - m_level0Frames);
+            if(m_format == SND_PCM_FORMAT_S16_LE){
+                reduceS16(reinterpret_cast<const int16_t*>(data), run, m_channels, m_level0.data());
+            } else {
+                run = std::min<size_t>(run, CONVERT_FRAMES);
+                for(size_t f = 0; f < run; f++){
+                    for(unsigned int c = 0; c < m_channels; c++){
+                        m_converted[f * m_channels + c] = sampleToS16(m_format, data + f * m_bytesPerSample + c * (m_bytesPerSample / m_channels));
+                    }
+                }
+                reduceS16(m_converted.data(), run, m_channels, m_level0.data());
+            }
+            data += run * m_bytesPerSample;
+            frames -= run;
+            m_level0Frames += run;
+            m_frames += run;
+            if(m_level0Frames == binFrames){
+                completeBin(0, m_level0, binFrames);
+                for(auto& acc : m_level0){
+                    acc.reset();
+                }
+                m_level0Frames = 0;
+            }
+        }
+    };
+
+    // write completed bins
+    bool flush(){
+        bool ok = true;
+        for(auto& level : m_levels){
+            ok &= writePending(level);
+        }
+        return ok;
+    };
+
+    // also writes the incomplete last bin of every level
+    void close(){
+        if(m_levels.empty()){
+            return;
+        }
+        // the partial bin of a level holds its own merged bins plus the partial bins below
+        std::vector<PeakAccumulator> partial = m_level0;
+        uint64_t frames = m_level0Frames;
+        for(size_t i = 0; i < m_levels.size(); i++){
+            Level& level = m_levels[i];
+            if(i > 0){
+                for(unsigned int c = 0; c < m_channels; c++){
+                    partial[c].merge(level.acc[c]);
+                }
+                frames += level.frames;
+            }
+            if(frames == 0){
+                continue;
+            }
+            for(unsigned int c = 0; c < m_channels; c++){
+                level.pending.push_back(partial[c].toBin(frames));
+            }
+        }
+        (void)flush();
+        for(auto& level : m_levels){
+            if(level.fd >= 0){
+                (void)::close(level.fd);
+            }
+        }
+        m_levels.clear();
+    };
+
+private:
+    static constexpr size_t CONVERT_FRAMES = 1024;
+    // bins buffered per level before they are written
+    static constexpr size_t PENDING_BINS = 64;
+
+    struct Level{
+        unsigned int binFrames = 0;
+        uint64_t frames = 0;                    // frames in acc
+        std::vector<PeakAccumulator> acc;       // merged complete bins of the level below
+        std::vector<PeakBin> pending;
+        int fd = -1;
+    };
+
+    PeakPyramidHeader m_header;
+    snd_pcm_format_t m_format = SND_PCM_FORMAT_S16_LE;
+    int m_bytesPerSample = 0;
+    unsigned int m_channels = 0;
+    uint64_t m_frames = 0;
+    std::vector<PeakAccumulator> m_level0;
+    uint64_t m_level0Frames = 0;
+    std::vector<int16_t> m_converted;
+    std::vector<Level> m_levels;
+
+    void completeBin(size_t index, const std::vector<PeakAccumulator>& acc, uint64_t frames){
+        Level& level = m_levels[index];
+        for(unsigned int c = 0; c < m_channels; c++){
+            level.pending.push_back(acc[c].toBin(frames));
+        }
+        if(level.pending.size() >= PENDING_BINS * m_channels){
+            (void)writePending(level);
+        }
+        if(index + 1 >= m_levels.size()){
+            return;
+        }
+        Level& next = m_levels[index + 1];
+        for(unsigned int c = 0; c < m_channels; c++){
+            next.acc[c].merge(acc[c]);
+        }
+        next.frames += frames;
+        if(next.frames == next.binFrames){
+            completeBin(index + 1, next.acc, next.frames);
+            for(auto& a : next.acc){
+                a.reset();
+            }
+            next.frames = 0;
+        }
+    };
+
+    bool writePending(Level& level){
+        if(level.pending.empty() || level.fd < 0){
+            return true;
+        }
+        size_t size = level.pending.size() * sizeof(PeakBin);
+        ssize_t res = ::write(level.fd, level.pending.data(), size);
+        level.pending.clear();
+        MSG_AND_RETURN_IF(res != (ssize_t)size, false, "Failed to write peaks");
+        return true;
+    };
+
+    // frames of the recording the existing peak files are valid for
+    uint64_t coveredFrames(const std::string& recording, uint64_t existingFrames){
+        if(existingFrames == 0){
+            return 0;
+        }
+        PeakPyramidHeader existing;
+        int fd = open((recording + PEAK_PYRAMID_SUFFIX).c_str(), O_RDONLY);
+        if(fd < 0){
+            return 0;
+        }
+        bool ok = pread(fd, &existing, sizeof(existing), 0) == sizeof(existing);
+        (void)::close(fd);
+        if(!ok || memcmp(&existing, &m_header, offsetof(PeakPyramidHeader, reserved)) != 0){
+            LOG_WARN("Existing peaks of %s do not match, rebuild them", recording.c_str());
+            return 0;
+        }
+        // complete bins of the coarsest level, everything after is rebuilt
+        uint64_t top = m_header.bin_frames[m_header.level_count - 1];
+        uint64_t covered = (existingFrames / top) * top;
+        for(size_t i = 0; i < m_header.level_count; i++){
+            struct stat st;
+            uint64_t bins = 0;
+            if(stat(peakLevelFileName(recording, i).c_str(), &st) == 0){
+                bins = st.st_size / (m_channels * sizeof(PeakBin));
+            }
+            covered = std::min<uint64_t>(covered, (bins * m_header.bin_frames[i] / top) * top);
+        }
+        return covered;
+    };
+
+    bool replay(const std::string& recording, uint64_t dataOffset, uint64_t from, uint64_t to){
+        int fd = open(recording.c_str(), O_RDONLY);
+        MSG_AND_RETURN_IF(fd < 0, false, "Can not open %s", recording.c_str());
+        std::vector<uint8_t> buffer(CONVERT_FRAMES * 64 * m_bytesPerSample);
+        bool ok = true;
+        while(from < to && ok){
+            size_t frames = std::min<uint64_t>(to - from, buffer.size() / m_bytesPerSample);
+            size_t size = frames * m_bytesPerSample;
+            ok = pread(fd, buffer.data(), size, dataOffset + from * m_bytesPerSample) == (ssize_t)size;
+            if(ok){
+                add(buffer.data(), frames);
+                from += frames;
+            }
+        }
+        (void)::close(fd);
+        return ok;
+    };
+};
+
+/*
+ * Reads the pyramid of a recording. Level files are mapped, a range only faults in the
+ * pages of its bins.
+ */
+class PeakPyramidReader{
+public:
+    PeakPyramidReader(){
+        TR_MSG("PeakPyramidReader");
+    };
+    ~PeakPyramidReader(){
+        close();
+    };
+
+    bool open(const std::string& recording){
+        TR();
+        close();
+        std::string headerFile = recording + PEAK_PYRAMID_SUFFIX;
+        int fd = ::open(headerFile.c_str(), O_RDONLY);
+        MSG_AND_RETURN_IF(fd < 0, false, "Can not open %s", headerFile.c_str());
+        bool ok = pread(fd, &m_header, sizeof(m_header), 0) == sizeof(m_header);
+        (void)::close(fd);
+        MSG_AND_RETURN_IF(!ok || m_header.magic != PEAK_PYRAMID_MAGIC || m_header.version != PEAK_PYRAMID_VERSION, false, "%s is no peak file", headerFile.c_str());
+        MSG_AND_RETURN_IF(m_header.channels == 0 || m_header.level_count == 0 || m_header.level_count > PEAK_PYRAMID_MAX_LEVELS, false, "Broken peak file %s", headerFile.c_str());
+        m_levels.resize(m_header.level_count);
+        for(size_t i = 0; i < m_levels.size(); i++){
+            std::string file = peakLevelFileName(recording, i);
+            fd = ::open(file.c_str(), O_RDONLY);
+            MSG_AND_RETURN_IF(fd < 0, false, "Can not open %s", file.c_str());
+            struct stat st;
+            if(fstat(fd, &st) == 0 && st.st_size > 0){
+                void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if(mem != MAP_FAILED){
+                    m_levels[i].bins = static_cast<const PeakBin*>(mem);
+                    m_levels[i].mapSize = st.st_size;
+                    m_levels[i].count = st.st_size / (m_header.channels * sizeof(PeakBin));
+                }
+            }
+            (void)::close(fd);
+        }
+        return true;
+    };
+
+    void close(){
+        for(auto& level : m_levels){
+            if(level.bins){
+                (void)munmap(const_cast<PeakBin*>(level.bins), level.mapSize);
+            }
+        }
+        m_levels.clear();
+    };
+
+    const PeakPyramidHeader& info() const {
+        return m_header;
+    };
+
+    size_t getLevelCount() const {
+        return m_levels.size();
+    };
+
+    unsigned int getBinFrames(size_t level) const {
+        return level < m_levels.size() ? m_header.bin_frames[level] : 0;
+    };
+
+    uint64_t getBinCount(size_t level) const {
+        return level < m_levels.size() ? m_levels[level].count : 0;
+    };
+
+    // coarsest level that still has at least one bin per pixel
+    size_t levelFor(uint64_t framesPerPixel) const {
+        size_t best = 0;
+        for(size_t i = 0; i < m_levels.size(); i++){
+            if(m_header.bin_frames[i] <= framesPerPixel){
+                best = i;
+            }
+        }
+        return best;
+    };
+
+    /*
+     * Bins [first, first + count) of a level, count is reduced to what exists.
+     * Bin b of channel c is result[b * channels + c]. Null if the range is empty.
+     */
+    const PeakBin* getBins(size_t level, uint64_t first, uint64_t& count) const {
+        if(level >= m_levels.size() || first >= m_levels[level].count){
+            count = 0;
+            return nullptr;
+        }
+        count = std::min(count, m_levels[level].count - first);
+        return m_levels[level].bins + first * m_header.channels;
+    };
+
+private:
+    struct Level{
+        const PeakBin* bins = nullptr;
+        size_t mapSize = 0;
+        uint64_t count = 0;
+    };
+
+    PeakPyramidHeader m_header;
+    std::vector<Level> m_levels;
+};
+
+#endif
@@ -0,0 +1,285 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _PERIOD_CLOCK_H_
+#define _PERIOD_CLOCK_H_
+
+extern "C"{
+#include <alsa/asoundlib.h>
+}
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#include "common.hpp"
+
+constexpr size_t DEFAULT_PERIOD_HISTORY = 1024;
+constexpr int64_t NS_PER_SEC = 1000000000LL;
+
+// a run of frames without xrun, linear in device time
+struct ClockSegment{
+    uint64_t frame = 0;         // first frame of the segment within the take
+    int64_t monotonicNs = 0;    // capture time of that frame
+    double nsPerFrame = 0.0;    // measured over the segment
+};
+
+struct PeriodStamp{
+    uint64_t frame = 0;         // index of the first frame of the period within the take
+    uint64_t frames = 0;        // number of frames in the period
+    int64_t monotonicNs = 0;    // CLOCK_MONOTONIC time the first frame was captured
+    bool xrun = false;          // frames were lost between the previous period and this one
+};
+
+inline int64_t timespecToNs(const struct timespec& ts){
+    return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Maps captured frames to CLOCK_MONOTONIC and tracks the drift of the device clock.
+ * After every period the pcm status is queried. The status timestamp (htstamp) marks the
+ * time the hw pointer was last updated, at that time all frames read so far plus the
+ * frames still available in the ring buffer had been captured. This gives the capture time
+ * of the first frame of the period. A least squares fit over all periods of the current
+ * segment (segments are split at xruns) gives the real rate of the device.
+ * The last historySize periods are kept in detail; every segment of the take keeps its
+ * first stamp and fitted rate, so frames older than the history are still mapped.
+ */
+class PeriodClock{
+public:
+    PeriodClock(){
+        TR_MSG("PeriodClock");
+    };
+    ~PeriodClock(){
+        if(m_status){
+            snd_pcm_status_free(m_status);
+        }
+    };
+
+    bool init(snd_pcm_t *handle, unsigned int rate, size_t historySize = DEFAULT_PERIOD_HISTORY){
+        TR();
+        MSG_AND_RETURN_IF(handle == nullptr, false, "Handle is null");
+        MSG_AND_RETURN_IF(rate == 0, false, "Invalid rate");
+        if(m_status == nullptr){
+            MSG_AND_RETURN_IF(snd_pcm_status_malloc(&m_status) < 0, false, "Could not allocate pcm status");
+        }
+        snd_pcm_sw_params_t *param;
+        snd_pcm_sw_params_alloca(&param);
+        MSG_AND_RETURN_IF(snd_pcm_sw_params_current(handle, param) < 0, false, "Sw Configuration for PCM broken.");
+        MSG_AND_RETURN_IF(snd_pcm_sw_params_set_tstamp_mode(handle, param, SND_PCM_TSTAMP_ENABLE) < 0, false, "Can not enable timestamps.");
+        // not supported by every plugin, the timestamps are converted below if this fails
+        m_monotonicStamps = snd_pcm_sw_params_set_tstamp_type(handle, param, SND_PCM_TSTAMP_TYPE_MONOTONIC) >= 0;
+        MSG_AND_RETURN_IF(snd_pcm_sw_params(handle, param) < 0, false, "Sw Configuration for PCM could not be installed.");
+        m_handle = handle;
+        m_rate = rate;
+        m_historySize = historySize;
+        reset();
+        return true;
+    };
+
+    // start of a new take, frame 0 is the next frame read
+    void reset(){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_history.clear();
+        m_segments.clear();
+        m_framesRead = 0;
+        m_driftPpm = 0.0;
+        m_nsPerFrame = (double)NS_PER_SEC / m_rate;
+        resetFit();
+    };
+
+    // called by the capture thread after a period of frames has been read, stamp of that period to out
+    bool onPeriod(uint64_t frames, bool xrun, PeriodStamp* out = nullptr){
+        MSG_AND_RETURN_IF(m_handle == nullptr, false, "Not initialized");
+        MSG_AND_RETURN_IF(snd_pcm_status(m_handle, m_status) < 0, false, "Could not get pcm status");
+        snd_htimestamp_t ts;
+        snd_pcm_status_get_htstamp(m_status, &ts);
+        int64_t stampNs = timespecToNs(ts);
+        if(stampNs == 0){
+            // device does not deliver timestamps, best effort
+            stampNs = monotonicNowNs();
+        } else if(!m_monotonicStamps){
+            stampNs += monotonicNowNs() - realtimeNowNs();
+        }
+        uint64_t avail = snd_pcm_status_get_avail(m_status);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        PeriodStamp stamp;
+        stamp.frame = m_framesRead;
+        stamp.frames = frames;
+        stamp.xrun = xrun;
+        // frames captured after the first frame of this period until stampNs
+        uint64_t capturedSince = frames + avail;
+        stamp.monotonicNs = stampNs - (int64_t)((double)capturedSince * NS_PER_SEC / m_rate);
+        m_framesRead += frames;
+
+        if(xrun){
+            // frame index and device time are not linear across an xrun
+            resetFit();
+        }
+        if(xrun || m_segments.empty()){
+            ClockSegment segment;
+            segment.frame = stamp.frame;
+            segment.monotonicNs = stamp.monotonicNs;
+            segment.nsPerFrame = m_nsPerFrame;
+            m_segments.push_back(segment);
+        }
+        addToFit(stamp);
+        m_segments.back().nsPerFrame = m_nsPerFrame;
+        m_history.push_back(stamp);
+        if(out){
+            *out = stamp;
+        }
+        while(m_history.size() > m_historySize){
+            m_history.pop_front();
+        }
+        return true;
+    };
+
+    // CLOCK_MONOTONIC capture time of a frame of the current take
+    int64_t frameToMonotonicNs(uint64_t frame) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_history.empty()){
+            return 0;
+        }
+        if(frame < m_history.front().frame){
+            // before the history: from the start of the segment the frame belongs to
+            auto seg = std::upper_bound(m_segments.begin(), m_segments.end(), frame,
+                                        [](uint64_t f, const ClockSegment& s){ return f < s.frame; });
+            const ClockSegment& segment = seg == m_segments.begin() ? *seg : *(seg - 1);
+            double delta = (double)frame - (double)segment.frame;
+            return segment.monotonicNs + (int64_t)(delta * segment.nsPerFrame);
+        }
+        // anchor at the last period starting at or before frame, periods are sorted by frame.
+        // Segments start at a period, so the anchor is in the segment of the frame
+        auto it = m_history.end();
+        while(it != m_history.begin() && (it - 1)->frame > frame){
+            --it;
+        }
+        const PeriodStamp& anchor = it == m_history.begin() ? *it : *(it - 1);
+        double delta = (double)frame - (double)anchor.frame;
+        return anchor.monotonicNs + (int64_t)(delta * m_nsPerFrame);
+    };
+
+    // positive: device runs faster than nominal rate
+    double getDriftPpm() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_driftPpm;
+    };
+
+    double getMeasuredRate() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return (double)NS_PER_SEC / m_nsPerFrame;
+    };
+
+    uint64_t getFramesRead() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_framesRead;
+    };
+
+    std::vector<PeriodStamp> getHistory() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return std::vector<PeriodStamp>(m_history.begin(), m_history.end());
+    };
+
+    // all segments of the current take, a new one starts at every xrun
+    std::vector<ClockSegment> getSegments() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_segments;
+    };
+
+    bool getLastStamp(PeriodStamp& stamp) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_history.empty()){
+            return false;
+        }
+        stamp = m_history.back();
+        return true;
+    };
+
+private:
+    // the fit needs a few periods before it is better than the nominal rate
+    static constexpr size_t MIN_FIT_POINTS = 16;
+
+    snd_pcm_t *m_handle = nullptr;
+    snd_pcm_status_t *m_status = nullptr;
+    bool m_monotonicStamps = false;
+    unsigned int m_rate = 48000;
+    size_t m_historySize = DEFAULT_PERIOD_HISTORY;
+    mutable std::mutex m_mutex;
+    std::deque<PeriodStamp> m_history;
+    std::vector<ClockSegment> m_segments;
+    uint64_t m_framesRead = 0;
+    double m_nsPerFrame = 0.0;
+    double m_driftPpm = 0.0;
+    // least squares sums relative to the first point of the segment to keep precision
+    uint64_t m_fitFrame0 = 0;
+    int64_t m_fitNs0 = 0;
+    double m_n = 0, m_sx = 0, m_sy = 0, m_sxx = 0, m_sxy = 0;
+
+    void resetFit(){
+        m_n = m_sx = m_sy = m_sxx = m_sxy = 0;
+    };
+
+    void addToFit(const PeriodStamp& stamp){
+        if(m_n == 0){
+            m_fitFrame0 = stamp.frame;
+            m_fitNs0 = stamp.monotonicNs;
+        }
+        double x = (double)(stamp.frame - m_fitFrame0);
+        double y = (double)(stamp.monotonicNs - m_fitNs0);
+        m_n += 1;
+        m_sx += x;
+        m_sy += y;
+        m_sxx += x * x;
+        m_sxy += x * y;
+        double denom = m_n * m_sxx - m_sx * m_sx;
+        if(m_n < MIN_FIT_POINTS || denom <= 0){
+            return;
+        }
+        double slope = (m_n * m_sxy - m_sx * m_sy) / denom;
+        if(slope <= 0){
+            return;
+        }
+        m_nsPerFrame = slope;
+        double measuredRate = (double)NS_PER_SEC / slope;
+        m_driftPpm = (measuredRate / m_rate - 1.0) * 1e6;
+    };
+
+    static int64_t monotonicNowNs(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return timespecToNs(ts);
+    };
+
+    static int64_t realtimeNowNs(){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return timespecToNs(ts);
+    };
+};
+
+#endif
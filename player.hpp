@@ -0,0 +1,150 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _PLAYER_H_
+#define _PLAYER_H_
+
+#include <climits>
+#include <thread>
+#include <atomic>
+#include <stdlib.h>
+
+#include "config.hpp"
+#include "snd_pcm_params.hpp"
+#include "handle.hpp"
+#include "common.hpp"
+#include "file_source.hpp"
+#include "pcm_io.hpp"
+
+constexpr int DEFAULT_PLAYER_SIZE_NEAR = 512;
+
+class Player{
+public:
+    Player(HwConfig &config, PlaybackConfig playback) : m_handle(), m_thread(), m_hwparams(), m_config(config), m_playback(playback)
+    {
+        TR_MSG("Player");
+    };
+    ~Player() {
+        m_stop = true;
+        if(m_thread.joinable()){
+            m_thread.join();
+        }
+    };
+
+    bool init(){
+        TR();
+        MSG_AND_RETURN_IF(!m_source.open(m_playback.file_name, m_config), false, "Could not open %s", m_playback.file_name.c_str());
+        const AudioFileInfo& info = m_source.info();
+        m_config.channels = info.channels;
+        m_config.rate = info.rate;
+        m_config.format = info.format;
+        m_config.stream = SND_PCM_STREAM_PLAYBACK;
+        if(m_config.size_near < 0){
+            m_config.size_near = DEFAULT_PLAYER_SIZE_NEAR;
+        }
+        MSG_AND_RETURN_IF(m_handle.init(m_config) == false, false, "Handle could not be initialized");
+        MSG_AND_RETURN_IF(m_hwparams.init(m_handle.get(), m_config) == false, false, "HwParams could not be initialized");
+        MSG_AND_RETURN_IF(m_swparams.init(m_handle.get(), m_config, m_hwparams.getPeriodSizeInSamples(), m_hwparams.getBufferSizeInSamples()) == false,
+                          false, "SwParams could not be initialized");
+        m_periodSizeInBytes = m_hwparams.getPeriodSizeInBytes();
+        MSG_AND_RETURN_IF(m_periodSizeInBytes <= 0, false, "Failed to get Period Size.");
+        m_bytesPerSample = m_hwparams.getBytesPerSample();
+        MSG_AND_RETURN_IF(m_bytesPerSample <= 0, false, "failed to get bytes per sample");
+        m_mmapAccess = isMmapAccess(m_config.access_mode);
+        m_init = true;
+        return true;
+    };
+
+    bool start(){
+        if(!m_init){
+            return false;
+        }
+        MSG_AND_RETURN_IF(m_thread.joinable() && !m_isFinished, false, "Playback still running");
+        if(m_thread.joinable()){
+            m_thread.join();
+        }
+        MSG_AND_RETURN_IF(!m_source.start(m_periodSizeInBytes, m_playback.prefetch_periods, m_playback.mmap_file), false, "Could not start prefetching");
+        m_stop = false;
+        m_isFinished = false;
+        m_stats.reset();
+        m_thread = std::thread(&Player::internalStart, this);
+        return true;
+    }
+
+    void stop(){
+        m_stop = true;
+    }
+
+    bool hasFinished(){
+        return m_isFinished;
+    }
+
+    // frames played and underruns of the current playback
+    const XrunStats& getStats() const {
+        return m_stats;
+    }
+
+private:
+    Handle m_handle;
+    std::thread m_thread;
+    HwParams m_hwparams;
+    SwParams m_swparams;
+    HwConfig m_config;
+    PlaybackConfig m_playback;
+    PrefetchReader m_source;
+    XrunStats m_stats;
+    std::atomic_bool m_stop{false};
+    std::atomic_bool m_isFinished{false};
+    bool m_init = false;
+    bool m_mmapAccess = false;
+    int m_periodSizeInBytes = 0;
+    int m_bytesPerSample = 0;
+
+    void internalStart(){
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        while(!m_stop && m_source.next(data, size)){
+            // a trailing partial frame can not be played
+            snd_pcm_uframes_t frames = size / m_bytesPerSample;
+            bool ok = writeToPcm(m_handle.get(), m_mmapAccess, data, frames, m_bytesPerSample, m_stats);
+            m_source.release();
+            if(!ok){
+                LOG_ERROR("Failed to write to pcm.");
+                break;
+            }
+        }
+        if(m_source.failed()){
+            LOG_ERROR("Reading %s failed", m_playback.file_name.c_str());
+        }
+        if(!m_stop){
+            // play what is still queued in the device
+            snd_pcm_drain(m_handle.get());
+        } else {
+            snd_pcm_drop(m_handle.get());
+        }
+        snd_pcm_prepare(m_handle.get());
+        m_isFinished = true;
+    }
+};
+
+#endif
@@ -24,6 +24,8 @@ SOFTWARE.
 #ifndef _RECORDER_H_
 #define _RECORDER_H_
 
+#include <algorithm>
+#include <chrono>
 #include <climits>
 #include <fstream>
 #include <thread>
@@ -36,6 +38,9 @@ SOFTWARE.
 #include "handle.hpp"
 #include "common.hpp"
 #include "capture_handle.hpp"
+#include "period_clock.hpp"
+#include "pcm_io.hpp"
+#include "adaptive_period.hpp"
 
 enum class DurationMs : int;
 enum class SampleCount : int;
@@ -49,22 +54,31 @@ public:
     {
         TR_MSG("Recorder");
     };
-    ~Recorder() {};
+    ~Recorder() {
+        m_stop = true;
+        if(m_thread.joinable()){
+            m_thread.join();
+        }
+    };
 
     bool init(){
         TR();
         if(m_config.size_near < 0){
             m_config.size_near = DEFAULT_RECORDER_SIZE_NEAR;
         }
+        if(m_config.adaptive.enabled){
+            m_config.size_near = std::max(m_config.adaptive.min_period, std::min(m_config.adaptive.max_period, m_config.size_near));
+            if(m_config.buffer_size_near < 0){
+                m_config.buffer_size_near = m_config.size_near * m_config.adaptive.buffer_periods;
+            }
+        }
         MSG_AND_RETURN_IF(m_handle.init(m_config) == false, false, "Handle could not be initialized");
-        MSG_AND_RETURN_IF(m_hwparams.init(m_handle.get(), m_config) == false, false, "HwParams could not be initialized");
-        m_periodTimeUs = m_hwparams.getPeriodTimeUs();
-        MSG_AND_RETURN_IF(m_periodTimeUs <= 0, false, "Failed to get Period Time.");
-        m_periodSizeInBytes = m_hwparams.getPeriodSizeInBytes();
-        MSG_AND_RETURN_IF(m_periodSizeInBytes < 0, false, "Failed to get Period Size.");
+        MSG_AND_RETURN_IF(configurePcm(m_config) == false, false, "Pcm could not be configured");
+        m_adaptive.init(m_config.adaptive, m_config.rate);
         int bytesPerSample = m_hwparams.getBytesPerSample();
         MSG_AND_RETURN_IF(bytesPerSample < 0, false, "failed to get bytes per sample");
         MSG_AND_RETURN_IF(m_capture.init(m_config, bytesPerSample) == false, false, "Failed init capture handler");
+        m_mmapAccess = isMmapAccess(m_config.access_mode);
         m_init = true;
         return true;
     };
@@ -78,10 +92,10 @@ public:
         if((int)duration < 0){
             return start();
         }
-        unsigned int durUs = static_cast<unsigned int>(duration) * 1000;
-        double periodCount = durUs / m_periodTimeUs;
-        double sampleCount = periodCount * (double)m_hwparams.getPeriodSizeInSamples();
-        SampleCount count = static_cast<SampleCount>(sampleCount+0.5); // magic to always round up
+        // exact number of frames, rounded to the nearest frame
+        uint64_t frames = ((uint64_t)duration * m_config.rate + 500) / 1000;
+        MSG_AND_RETURN_IF(frames > INT_MAX, false, "Duration %d ms too long", (int)duration);
+        SampleCount count = static_cast<SampleCount>(frames);
         return start(count);
     }
 
@@ -89,8 +103,19 @@ public:
         if(!m_init){
             return false;
         }
+        MSG_AND_RETURN_IF(m_thread.joinable() && !m_isFinished, false, "Recording still running");
+        if(m_thread.joinable()){
+            m_thread.join();
+            if(m_config.adaptive.enabled && !renegotiate(m_adaptive.nextPeriodSize())){
+                LOG_WARN("Renegotiation failed, keep period size %d", m_hwparams.getPeriodSizeInSamples());
+            }
+        }
+        m_adaptive.startTake(m_hwparams.getPeriodSizeInSamples(), m_periodTimeUs);
         m_stop = false;
         m_isFinished = false;
+        m_stats.reset();
+        m_clock.reset();
+        m_capture.startTake();
         m_thread = std::thread(&Recorder::internalStart, this, (int)count);
         return true;
     }
@@ -106,70 +131,129 @@ public:
         return m_isFinished;
     }
 
+    int getPeriodSizeInSamples(){
+        return m_hwparams.getPeriodSizeInSamples();
+    }
+
+    int getBufferSizeInSamples(){
+        return m_hwparams.getBufferSizeInSamples();
+    }
+
+    // frames captured and overruns of the current take
+    const XrunStats& getStats() const {
+        return m_stats;
+    }
+
+    // DURABILITY::INTERVAL: the files could not be synced lately, capture goes on meanwhile
+    bool isSyncFailing() const {
+        return m_capture.syncFailed();
+    }
+
+    // per period timestamps, frame to CLOCK_MONOTONIC mapping and device clock drift of the current take
+    const PeriodClock& getClock() const {
+        return m_clock;
+    }
+
 private:
     Handle m_handle;
     std::thread m_thread;
     HwParams m_hwparams;
+    SwParams m_swparams;
     HwConfig m_config;
     CaptureHandle m_capture;
+    PeriodClock m_clock;
+    AdaptivePeriod m_adaptive;
     std::atomic_bool m_stop{false};
     std::atomic_bool m_isFinished{false};
     bool m_init = false;
     int m_periodTimeUs = 0;
     int m_periodSizeInBytes = 0;
+    bool m_xrun = false;
+    bool m_mmapAccess = false;
+    XrunStats m_stats;
 
-    void internalStart(int totalSamplesToRead){
-        int bytesPerSample = m_hwparams.getBytesPerSample();
+    // hw params, sw params and everything derived from them
+    bool configurePcm(HwConfig& config){
+        MSG_AND_RETURN_IF(m_hwparams.init(m_handle.get(), config) == false, false, "HwParams could not be initialized");
+        int periodSize = m_hwparams.getPeriodSizeInSamples();
+        int bufferSize = m_hwparams.getBufferSizeInSamples();
+        MSG_AND_RETURN_IF(periodSize <= 0 || bufferSize <= 0, false, "Invalid period|buffer size %d|%d", periodSize, bufferSize);
+        MSG_AND_RETURN_IF(m_swparams.init(m_handle.get(), config, periodSize, bufferSize) == false, false, "SwParams could not be initialized");
+        MSG_AND_RETURN_IF(m_clock.init(m_handle.get(), config.rate) == false, false, "PeriodClock could not be initialized");
+        m_periodTimeUs = m_hwparams.getPeriodTimeUs();
+        MSG_AND_RETURN_IF(m_periodTimeUs <= 0, false, "Failed to get Period Time.");
+        m_periodSizeInBytes = m_hwparams.getPeriodSizeInBytes();
+        MSG_AND_RETURN_IF(m_periodSizeInBytes < 0, false, "Failed to get Period Size.");
+        return true;
+    }
 
-        unsigned int totalBytesToRead = totalSamplesToRead * bytesPerSample;
-        unsigned int loopCount = totalBytesToRead / m_periodSizeInBytes;
+    // between takes only, the pcm is stopped for it
+    bool renegotiate(int periodSize){
+        if(periodSize <= 0 || periodSize == m_hwparams.getPeriodSizeInSamples()){
+            return true;
+        }
+        LOG_INFO("Renegotiate period size %d -> %d", m_hwparams.getPeriodSizeInSamples(), periodSize);
+        HwConfig config = m_config;
+        config.size_near = periodSize;
+        config.buffer_size_near = periodSize * std::max(2u, m_config.adaptive.buffer_periods);
+        snd_pcm_drop(m_handle.get());
+        if(!configurePcm(config)){
+            // back to what worked before
+            MSG_AND_RETURN_IF(!configurePcm(m_config), false, "Could not restore previous configuration");
+            return false;
+        }
+        m_config = config;
+        return true;
+    }
 
-        u_char* buffer = (u_char*)malloc(m_periodSizeInBytes);
-        off_t bytesRead = 0;
+    void internalStart(int totalSamplesToRead){
+        int bytesPerSample = m_hwparams.getBytesPerSample();
         int samplesPerPeriod = m_hwparams.getPeriodSizeInSamples();
         if(bytesPerSample < 0 || samplesPerPeriod < 0 ){
-            TR_MSG("Abort. Samples|Bytes = %d|%d",samplesPerPeriod, bytesPerSample);
+            LOG_ERROR("Abort. Samples|Bytes = %d|%d",samplesPerPeriod, bytesPerSample);
             m_isFinished = true;
             return;
         }
+
+        u_char* buffer = (u_char*)malloc(m_periodSizeInBytes);
+        if(buffer == nullptr){
+            LOG_ERROR("Could not allocate period buffer");
+            m_isFinished = true;
+            return;
+        }
+        uint64_t samplesRead = 0;
+        m_xrun = false;
         TR_MSG("Attempt to read %d samples", totalSamplesToRead);
-        while((!m_stop && totalSamplesToRead == INFINITE) 
-              || ( totalSamplesToRead != INFINITE && bytesRead < totalBytesToRead && !m_stop)) {
+        while(!m_stop && (totalSamplesToRead == INFINITE || samplesRead < (uint64_t)totalSamplesToRead)) {
+            snd_pcm_uframes_t toRead = samplesPerPeriod;
+            if(totalSamplesToRead != INFINITE){
+                // last period of a limited take is only partially read
+                toRead = std::min<uint64_t>(toRead, (uint64_t)totalSamplesToRead - samplesRead);
+            }
             size_t read = 0;
-            if(!readFromPcm(buffer, samplesPerPeriod, bytesPerSample, read)) {
+            if(!readFromPcm(m_handle.get(), m_mmapAccess, buffer, toRead, bytesPerSample, read, m_stats, m_xrun)) {
                 break;
             }
-            bytesRead += read;
+            samplesRead += toRead;
+            PeriodStamp stamp;
+            bool hasStamp = m_clock.onPeriod(toRead, m_xrun, &stamp);
+            bool xrun = m_xrun;
+            m_xrun = false;
 
-            if(!m_capture.write(buffer, read)) {
-                TR_MSG("Failed to write.");
+            auto sinkStart = std::chrono::steady_clock::now();
+            if(!m_capture.write(buffer, read, hasStamp ? &stamp : nullptr)) {
+                LOG_ERROR("Failed to write.");
                 break;
             }
+            if(m_config.adaptive.enabled){
+                auto sinkNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - sinkStart).count();
+                m_adaptive.onPeriod(sinkNs, xrun);
+            }
         }
+        free(buffer);
         m_isFinished = true;
     }
 
-    bool readFromPcm(u_char* buff, snd_pcm_uframes_t samplesToRead, int bytesPerSample, size_t &read){
-        size_t readCountTotal = 0;
-        while(readCountTotal < samplesToRead) {
-            ssize_t readCount = 0;
-            buff += (readCount * bytesPerSample);
-            snd_pcm_uframes_t toRead = samplesToRead - readCountTotal;
-            readCount = snd_pcm_readi(m_handle.get(), buff, toRead);
-            if (readCount == -EPIPE) {
-                TR_MSG("pipe overrun occurred");
-                snd_pcm_prepare(m_handle.get());
-                continue;
-            }
-            if(readCount < 0){
-                TR_MSG("General Error. Abort");
-                return false;
-            }
-            readCountTotal += readCount;
-        }
-        read = readCountTotal * bytesPerSample ;
-        return true;
-    };
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,498 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _SEEK_INDEX_H_
+#define _SEEK_INDEX_H_
+
+#include <algorithm>
+#include <string>
+#include <stdint.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.hpp"
+#include "config.hpp"
+#include "period_clock.hpp"
+
+/*
+ * Sidecar index of a recording (<recording>.idx), written while capturing.
+ *
+ *   [SeekIndexHeader][SeekIndexEntry 0][SeekIndexEntry 1]...
+ *
+ * Entry i describes frame i * frames_per_entry of the recording, so the entry of any
+ * frame is found without searching. Each entry holds the byte offset of its frame, the
+ * CLOCK_MONOTONIC capture time and the segment the frame belongs to. A new segment starts
+ * with every take and after every xrun, i.e. wherever time is not continuous.
+ */
+constexpr uint32_t SEEK_INDEX_MAGIC = 0x58495241; // "ARIX"
+constexpr uint32_t SEEK_INDEX_VERSION = 1;
+constexpr uint32_t SEEK_INDEX_ENTRIES_PER_SEC = 10;
+const std::string SEEK_INDEX_SUFFIX = ".idx";
+
+enum SEEK_INDEX_FLAGS{
+  SEGMENT_START = 0x1,  // a segment started since the previous entry, at segment_start_frame
+  XRUN          = 0x2,  // that segment was started by an xrun
+  NO_TIME       = 0x4   // no capture time known for this entry
+};
+
+struct SeekIndexHeader{
+  uint32_t magic = SEEK_INDEX_MAGIC;
+  uint32_t version = SEEK_INDEX_VERSION;
+  uint32_t rate = 0;
+  uint32_t channels = 0;
+  uint32_t bytes_per_frame = 0;
+  int32_t format = SND_PCM_FORMAT_UNKNOWN;
+  uint64_t data_offset = 0;                 // byte offset of frame 0 in the recording
+  uint64_t frames_per_entry = 0;
+  uint8_t reserved[24] = {0};
+};
+static_assert(sizeof(SeekIndexHeader) == 64, "index header is part of the file format");
+
+struct SeekIndexEntry{
+  uint64_t byte_offset = 0;                 // of frame i * frames_per_entry in the recording
+  int64_t monotonic_ns = 0;                 // capture time of that frame
+  uint64_t segment_start_frame = 0;         // first frame of the segment of that frame
+  uint32_t segment = 0;
+  uint32_t flags = 0;
+};
+static_assert(sizeof(SeekIndexEntry) == 32, "index entry is part of the file format");
+
+inline bool fileSize(const std::string& name, uint64_t& size){
+    struct stat st;
+    if(stat(name.c_str(), &st) < 0){
+        return false;
+    }
+    size = st.st_size;
+    return true;
+}
+
+class SeekIndexWriter{
+public:
+    SeekIndexWriter(){
+        TR_MSG("SeekIndexWriter");
+    };
+    ~SeekIndexWriter(){
+        close();
+    };
+
+    /*
+     * existingDataBytes: audio data already in the recording (appending to an existing file).
+     * An existing index is continued if it matches, otherwise it is rebuilt without times.
+     */
+    bool init(const std::string& file, uint64_t dataOffset, uint64_t existingDataBytes,
+              const HwConfig& streamInfo, int bytesPerSample, unsigned int framesPerEntry = 0){
+        TR();
+        LOG_AND_RETURN_IF(LOG_DEBUG, m_fd >= 0, true, "Already initialized");
+        MSG_AND_RETURN_IF(bytesPerSample <= 0, false, "Invalid bytes per sample %d", bytesPerSample);
+        m_header.rate = streamInfo.rate;
+        m_header.channels = streamInfo.channels;
+        m_header.bytes_per_frame = bytesPerSample;
+        m_header.format = streamInfo.format;
+        m_header.data_offset = dataOffset;
+        m_header.frames_per_entry = framesPerEntry > 0 ? framesPerEntry : std::max(1u, streamInfo.rate / SEEK_INDEX_ENTRIES_PER_SEC);
+        m_frames = existingDataBytes / bytesPerSample;
+
+        m_fd = open(file.c_str(), O_RDWR | O_CREAT, 0644);
+        MSG_AND_RETURN_IF(m_fd < 0, false, "Failed to open index %s", file.c_str());
+        if(!continueExisting()){
+            MSG_AND_RETURN_IF(ftruncate(m_fd, 0) < 0, false, "Failed to truncate index %s", file.c_str());
+            MSG_AND_RETURN_IF(pwrite(m_fd, &m_header, sizeof(m_header), 0) != sizeof(m_header), false, "Failed to write index header");
+            m_entries = 0;
+            m_segment = 0;
+            m_segmentStart = 0;
+        }
+        // audio already in the file but not indexed yet
+        uint64_t existing = m_frames;
+        m_frames = std::min(existing, m_entries * m_header.frames_per_entry);
+        m_newSegment = false;
+        MSG_AND_RETURN_IF(!addEntries(existing - m_frames, nullptr), false, "Failed to index existing data");
+        m_newSegment = true;
+        return true;
+    };
+
+    // next frames belong to a new take
+    void startSegment(){
+        m_newSegment = true;
+    };
+
+    // account frames written to the recording, stamp describes their capture time (may be null)
+    bool add(uint64_t frames, const PeriodStamp* stamp){
+        if(m_fd < 0){
+            return false;
+        }
+        if(stamp && stamp->xrun){
+            m_newSegment = true;
+            m_segmentXrun = true;
+        }
+        return addEntries(frames, stamp);
+    };
+
+    void close(){
+        if(m_fd >= 0){
+            (void)::close(m_fd);
+            m_fd = -1;
+        }
+    };
+
+private:
+    int m_fd = -1;
+    SeekIndexHeader m_header;
+    uint64_t m_frames = 0;          // frames of the recording accounted so far
+    uint64_t m_entries = 0;         // entries in the file
+    uint32_t m_segment = 0;
+    uint64_t m_segmentStart = 0;
+    bool m_newSegment = true;
+    bool m_segmentXrun = false;
+    bool m_segmentFlagPending = false;
+
+    bool continueExisting(){
+        SeekIndexHeader existing;
+        if(pread(m_fd, &existing, sizeof(existing), 0) != sizeof(existing)){
+            return false;
+        }
+        if(existing.magic != SEEK_INDEX_MAGIC || existing.version != SEEK_INDEX_VERSION
+           || existing.rate != m_header.rate || existing.channels != m_header.channels
+           || existing.bytes_per_frame != m_header.bytes_per_frame || existing.format != m_header.format
+           || existing.data_offset != m_header.data_offset){
+            LOG_WARN("Existing index does not match the stream, rebuild it");
+            return false;
+        }
+        m_header.frames_per_entry = existing.frames_per_entry;
+        struct stat st;
+        if(fstat(m_fd, &st) < 0){
+            return false;
+        }
+        m_entries = (st.st_size - sizeof(SeekIndexHeader)) / sizeof(SeekIndexEntry);
+        // entries beyond the audio data are left over from a crash
+        uint64_t maxEntries = m_frames == 0 ? 0 : (m_frames - 1) / m_header.frames_per_entry + 1;
+        m_entries = std::min(m_entries, maxEntries);
+        MSG_AND_RETURN_IF(ftruncate(m_fd, sizeof(SeekIndexHeader) + m_entries * sizeof(SeekIndexEntry)) < 0, false, "Failed to trim index");
+        if(m_entries > 0){
+            SeekIndexEntry last;
+            off_t pos = sizeof(SeekIndexHeader) + (m_entries - 1) * sizeof(SeekIndexEntry);
+            if(pread(m_fd, &last, sizeof(last), pos) != sizeof(last)){
+                return false;
+            }
+            m_segment = last.segment;
+            m_segmentStart = last.segment_start_frame;
+        }
+        return true;
+    };
+
+    bool addEntries(uint64_t frames, const PeriodStamp* stamp){
+        const uint64_t first = m_frames;
+        const uint64_t end = m_frames + frames;
+        if(frames > 0 && m_newSegment){
+            m_segment += m_entries > 0 || first > 0 ? 1 : 0;
+            m_segmentStart = first;
+            m_segmentFlagPending = true;
+            m_newSegment = false;
+        }
+        // a handful of entries per period at most, keep them on the stack
+        constexpr size_t MAX_BATCH = 64;
+        SeekIndexEntry batch[MAX_BATCH];
+        size_t count = 0;
+        const uint64_t step = m_header.frames_per_entry;
+        while(m_entries * step < end){
+            uint64_t frame = m_entries * step;
+            SeekIndexEntry& entry = batch[count];
+            entry = SeekIndexEntry();
+            entry.byte_offset = m_header.data_offset + frame * m_header.bytes_per_frame;
+            entry.segment = m_segment;
+            entry.segment_start_frame = m_segmentStart;
+            if(m_segmentFlagPending){
+                // first entry at or after the segment start, the segment may begin before its
+                // frame: the flag and segment_start_frame tell readers where exactly
+                entry.flags |= SEEK_INDEX_FLAGS::SEGMENT_START | (m_segmentXrun ? SEEK_INDEX_FLAGS::XRUN : 0);
+                m_segmentFlagPending = false;
+                m_segmentXrun = false;
+            }
+            if(stamp){
+                entry.monotonic_ns = stamp->monotonicNs + (int64_t)((double)(frame - first) * NS_PER_SEC / m_header.rate);
+            } else {
+                entry.flags |= SEEK_INDEX_FLAGS::NO_TIME;
+            }
+            m_entries++;
+            if(++count == MAX_BATCH && !flush(batch, count)){
+                return false;
+            }
+        }
+        m_frames = end;
+        return flush(batch, count);
+    };
+
+    bool flush(SeekIndexEntry* batch, size_t& count){
+        if(count == 0){
+            return true;
+        }
+        size_t size = count * sizeof(SeekIndexEntry);
+        off_t pos = sizeof(SeekIndexHeader) + (m_entries - count) * sizeof(SeekIndexEntry);
+        count = 0;
+        MSG_AND_RETURN_IF(pwrite(m_fd, batch, size, pos) != (ssize_t)size, false, "Failed to write index entries");
+        return true;
+    };
+};
+
+// frames of a recording, points directly into the mapped file
+struct FrameSpan{
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    uint64_t firstFrame = 0;
+    uint64_t frames = 0;
+};
+
+/*
+ * Random access to a recording through its index. Recording and index are mapped,
+ * only the pages of the requested range are read from disk.
+ */
+class RecordingReader{
+public:
+    RecordingReader(){
+        TR_MSG("RecordingReader");
+    };
+    ~RecordingReader(){
+        close();
+    };
+
+    // index defaults to <recording>.idx
+    bool open(const std::string& recording, std::string index = ""){
+        TR();
+        close();
+        if(index.empty()){
+            index = recording + SEEK_INDEX_SUFFIX;
+        }
+        MSG_AND_RETURN_IF(!map(index, m_indexMap, m_indexSize), false, "Could not map index %s", index.c_str());
+        MSG_AND_RETURN_IF(m_indexSize < sizeof(SeekIndexHeader), false, "Index %s too small", index.c_str());
+        memcpy(&m_header, m_indexMap, sizeof(m_header));
+        MSG_AND_RETURN_IF(m_header.magic != SEEK_INDEX_MAGIC || m_header.version != SEEK_INDEX_VERSION, false, "%s is no seek index", index.c_str());
+        MSG_AND_RETURN_IF(m_header.bytes_per_frame == 0 || m_header.frames_per_entry == 0, false, "Broken index %s", index.c_str());
+        m_entries = reinterpret_cast<const SeekIndexEntry*>(m_indexMap + sizeof(SeekIndexHeader));
+        m_entryCount = (m_indexSize - sizeof(SeekIndexHeader)) / sizeof(SeekIndexEntry);
+        // once per open: a rebuilt index starts with a long run of entries without time
+        m_firstTimed = 0;
+        while(m_firstTimed < m_entryCount && !timed(m_firstTimed)){
+            m_firstTimed++;
+        }
+
+        MSG_AND_RETURN_IF(!map(recording, m_dataMap, m_dataSize), false, "Could not map recording %s", recording.c_str());
+        // excerpts are small and anywhere in the file, no read ahead over the whole recording
+        (void)madvise(const_cast<uint8_t*>(m_dataMap), m_dataSize, MADV_RANDOM);
+        m_frames = m_dataSize > m_header.data_offset ? (m_dataSize - m_header.data_offset) / m_header.bytes_per_frame : 0;
+        return true;
+    };
+
+    void close(){
+        unmap(m_indexMap, m_indexSize);
+        unmap(m_dataMap, m_dataSize);
+        m_entries = nullptr;
+        m_entryCount = 0;
+        m_firstTimed = 0;
+        m_frames = 0;
+    };
+
+    const SeekIndexHeader& info() const {
+        return m_header;
+    };
+
+    uint64_t getFrameCount() const {
+        return m_frames;
+    };
+
+    size_t getEntryCount() const {
+        return m_entryCount;
+    };
+
+    const SeekIndexEntry* getEntry(uint64_t frame) const {
+        uint64_t i = frame / m_header.frames_per_entry;
+        return i < m_entryCount ? &m_entries[i] : nullptr;
+    };
+
+    bool getFrames(uint64_t first, uint64_t count, FrameSpan& span) const {
+        if(m_dataMap == nullptr || first >= m_frames){
+            return false;
+        }
+        count = std::min(count, m_frames - first);
+        span.data = m_dataMap + m_header.data_offset + first * m_header.bytes_per_frame;
+        span.size = count * m_header.bytes_per_frame;
+        span.firstFrame = first;
+        span.frames = count;
+        return true;
+    };
+
+    // frames captured in [startNs, endNs) CLOCK_MONOTONIC
+    bool getTimeRange(int64_t startNs, int64_t endNs, FrameSpan& span) const {
+        uint64_t first = 0;
+        uint64_t last = 0;
+        if(endNs <= startNs || !frameForTime(startNs, first) || !frameForTime(endNs, last)){
+            return false;
+        }
+        return getFrames(first, std::max<uint64_t>(last - first, 1), span);
+    };
+
+    /*
+     * First frame captured at or after timeNs. Entries without time (data indexed after the
+     * fact, e.g. appended to after a crash) are skipped: the search only compares timed
+     * entries and steps over untimed runs, which are short apart from a rebuilt prefix.
+     */
+    bool frameForTime(int64_t timeNs, uint64_t& frame) const {
+        if(m_firstTimed >= m_entryCount){
+            return false;
+        }
+        const uint64_t n = m_entryCount;
+        const uint64_t step0 = m_header.frames_per_entry;
+        // time is linear within a segment: guess the entry from the first timed entry, then
+        // correct locally. Only gaps (xruns, pauses between takes) need a few more steps.
+        const double nsPerEntry = (double)step0 * NS_PER_SEC / m_header.rate;
+        const SeekIndexEntry& ref = m_entries[m_firstTimed];
+        if(timeNs < ref.monotonic_ns){
+            frame = std::min(m_firstTimed * step0, m_frames);
+            return true;
+        }
+        uint64_t guess = m_firstTimed + (uint64_t)((double)(timeNs - ref.monotonic_ns) / nsPerEntry);
+        guess = prevTimed(std::min<uint64_t>(guess, n - 1), m_firstTimed);
+        // lo: timed entry with time <= timeNs. hi: timed entries from hi on are later than timeNs
+        uint64_t lo = guess;
+        uint64_t hi = n;
+        uint64_t step = 1;
+        if(m_entries[guess].monotonic_ns <= timeNs){
+            // gallop forward, without gaps this is one step
+            while(lo + step < n){
+                uint64_t t = timedNear(lo, lo + step, n);
+                if(t == n){
+                    break;
+                }
+                if(m_entries[t].monotonic_ns > timeNs){
+                    hi = t;
+                    break;
+                }
+                lo = t;
+                step *= 2;
+            }
+        } else {
+            // gallop backward, the first timed entry is <= timeNs
+            hi = guess;
+            while(true){
+                uint64_t t = prevTimed(hi - std::min(step, hi - m_firstTimed), m_firstTimed);
+                if(m_entries[t].monotonic_ns <= timeNs){
+                    lo = t;
+                    break;
+                }
+                hi = t;
+                step *= 2;
+            }
+        }
+        // last timed entry with time <= timeNs
+        while(true){
+            uint64_t t = timedNear(lo, lo + (hi - lo) / 2, hi);
+            if(t == hi){
+                break;
+            }
+            if(m_entries[t].monotonic_ns <= timeNs){
+                lo = t;
+            } else {
+                hi = t;
+            }
+        }
+        const SeekIndexEntry& entry = m_entries[lo];
+        uint64_t offset = (uint64_t)((double)(timeNs - entry.monotonic_ns) * m_header.rate / NS_PER_SEC + 0.5);
+        // do not run into the next entry, it may start after a gap
+        frame = std::min(lo * step0 + std::min<uint64_t>(offset, step0), m_frames);
+        return true;
+    };
+
+private:
+    SeekIndexHeader m_header;
+    const uint8_t* m_indexMap = nullptr;
+    size_t m_indexSize = 0;
+    const uint8_t* m_dataMap = nullptr;
+    size_t m_dataSize = 0;
+    const SeekIndexEntry* m_entries = nullptr;
+    uint64_t m_entryCount = 0;
+    uint64_t m_frames = 0;
+
+    uint64_t m_firstTimed = 0;      // first entry with a time, m_entryCount if none
+
+    bool timed(uint64_t i) const {
+        return !(m_entries[i].flags & SEEK_INDEX_FLAGS::NO_TIME);
+    };
+
+    // last timed entry in [floor, i], floor has to be timed
+    uint64_t prevTimed(uint64_t i, uint64_t floor) const {
+        while(i > floor && !timed(i)){
+            i--;
+        }
+        return i;
+    };
+
+    // a timed entry in (lo, hi) close to mid (lo < mid), preferring the ones before; hi if none
+    uint64_t timedNear(uint64_t lo, uint64_t mid, uint64_t hi) const {
+        if(lo + 1 >= hi){
+            return hi;
+        }
+        mid = std::max(lo + 1, std::min(mid, hi - 1));
+        for(uint64_t i = mid; i > lo; i--){
+            if(timed(i)){
+                return i;
+            }
+        }
+        for(uint64_t i = mid + 1; i < hi; i++){
+            if(timed(i)){
+                return i;
+            }
+        }
+        return hi;
+    };
+
+    static bool map(const std::string& file, const uint8_t*& ptr, size_t& size){
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if(fd < 0){
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd, &st) < 0 || st.st_size == 0){
+            (void)::close(fd);
+            return false;
+        }
+        void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        (void)::close(fd);
+        if(mem == MAP_FAILED){
+            return false;
+        }
+        ptr = static_cast<const uint8_t*>(mem);
+        size = st.st_size;
+        return true;
+    };
+
+    static void unmap(const uint8_t*& ptr, size_t& size){
+        if(ptr){
+            (void)munmap(const_cast<uint8_t*>(ptr), size);
+        }
+        ptr = nullptr;
+        size = 0;
+    };
+};
+
+#endif
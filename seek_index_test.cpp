@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "config.hpp"
+#include "seek_index.hpp"
+
+// RecordingReader::frameForTime against a linear scan of the index. Returns non zero on failure.
+
+constexpr unsigned int TEST_RATE = 48000;
+constexpr int TEST_BYTES_PER_FRAME = 2;
+constexpr unsigned int TEST_FRAMES_PER_ENTRY = 4800;
+constexpr uint64_t TEST_PERIOD_FRAMES = 480;
+constexpr int64_t TEST_PERIOD_NS = TEST_PERIOD_FRAMES * NS_PER_SEC / TEST_RATE;
+const std::string TEST_FILE = "seek_index_test.raw";
+
+static bool appendSilence(uint64_t frames){
+    std::vector<uint8_t> zeros(frames * TEST_BYTES_PER_FRAME);
+    FILE* f = fopen(TEST_FILE.c_str(), "ab");
+    bool ok = f && fwrite(zeros.data(), 1, zeros.size(), f) == zeros.size();
+    if(f){
+        ok &= fclose(f) == 0;
+    }
+    return ok;
+}
+
+/*
+ * 10 s recorded before the index existed (untimed prefix), then takes of timed periods,
+ * each with an xrun gap in the middle and followed by an untimed run and a pause.
+ * Returns the time after the last take.
+ */
+static bool writeRecording(int64_t& endNs){
+    HwConfig config{};
+    config.channels = 1;
+    config.rate = TEST_RATE;
+    config.format = SND_PCM_FORMAT_S16_LE;
+    const uint64_t prefix = 10 * TEST_RATE;
+    (void)std::remove(TEST_FILE.c_str());
+    (void)std::remove((TEST_FILE + SEEK_INDEX_SUFFIX).c_str());
+    if(!appendSilence(prefix)){
+        return false;
+    }
+    SeekIndexWriter writer;
+    if(!writer.init(TEST_FILE + SEEK_INDEX_SUFFIX, 0, prefix * TEST_BYTES_PER_FRAME, config, TEST_BYTES_PER_FRAME, TEST_FRAMES_PER_ENTRY)){
+        return false;
+    }
+    int64_t t = 5 * NS_PER_SEC;
+    for(int take = 0; take < 3; take++){
+        writer.startSegment();
+        for(int p = 0; p < 100; p++){
+            PeriodStamp stamp;
+            stamp.frames = TEST_PERIOD_FRAMES;
+            stamp.monotonicNs = t;
+            // frames lost: time jumps, the index starts a new segment
+            stamp.xrun = p == 37;
+            if(stamp.xrun){
+                stamp.monotonicNs = t += 500 * 1000000LL;
+            }
+            if(!writer.add(TEST_PERIOD_FRAMES, &stamp) || !appendSilence(TEST_PERIOD_FRAMES)){
+                return false;
+            }
+            t += TEST_PERIOD_NS;
+        }
+        // a second without times, then a pause before the next take
+        if(!writer.add(TEST_RATE, nullptr) || !appendSilence(TEST_RATE)){
+            return false;
+        }
+        t += 3 * NS_PER_SEC;
+    }
+    endNs = t;
+    return true;
+}
+
+// last timed entry at or before timeNs, the first timed one if there is none
+static uint64_t linearFrameForTime(const RecordingReader& reader, int64_t timeNs){
+    const uint64_t step = reader.info().frames_per_entry;
+    int64_t best = -1;
+    int64_t firstTimed = -1;
+    for(uint64_t i = 0; i < reader.getEntryCount(); i++){
+        const SeekIndexEntry* entry = reader.getEntry(i * step);
+        if(entry->flags & SEEK_INDEX_FLAGS::NO_TIME){
+            continue;
+        }
+        if(firstTimed < 0){
+            firstTimed = i;
+        }
+        if(entry->monotonic_ns <= timeNs){
+            best = i;
+        }
+    }
+    if(best < 0){
+        return std::min<uint64_t>(firstTimed * step, reader.getFrameCount());
+    }
+    const SeekIndexEntry* entry = reader.getEntry(best * step);
+    uint64_t offset = (uint64_t)((double)(timeNs - entry->monotonic_ns) * TEST_RATE / NS_PER_SEC + 0.5);
+    return std::min<uint64_t>(best * step + std::min<uint64_t>(offset, step), reader.getFrameCount());
+}
+
+int main(){
+    int64_t endNs = 0;
+    if(!writeRecording(endNs)){
+        fprintf(stderr, "could not write %s\n", TEST_FILE.c_str());
+        return 1;
+    }
+    RecordingReader reader;
+    if(!reader.open(TEST_FILE)){
+        fprintf(stderr, "could not open %s\n", TEST_FILE.c_str());
+        return 1;
+    }
+    uint64_t queries = 0;
+    uint64_t bad = 0;
+    // from before the first timed entry to past the end, 37 ms apart to hit entries at varying offsets
+    for(int64_t q = 4 * NS_PER_SEC; q < endNs + NS_PER_SEC; q += 37 * 1000000LL, queries++){
+        uint64_t frame = 0;
+        uint64_t expected = linearFrameForTime(reader, q);
+        if(!reader.frameForTime(q, frame) || frame != expected){
+            if(bad < 10){
+                fprintf(stderr, "time %ld: frame %lu, expected %lu\n", (long)q, (unsigned long)frame, (unsigned long)expected);
+            }
+            bad++;
+        }
+    }
+    printf("seek_index_frame_for_time: %lu entries, %lu queries, %lu wrong\n",
+           (unsigned long)reader.getEntryCount(), (unsigned long)queries, (unsigned long)bad);
+    (void)std::remove(TEST_FILE.c_str());
+    (void)std::remove((TEST_FILE + SEEK_INDEX_SUFFIX).c_str());
+    bool ok = bad == 0 && queries > 0;
+    printf("%s\n", ok ? "PASSED" : "FAILED");
+    return ok ? 0 : 1;
+}
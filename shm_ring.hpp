@@ -0,0 +1,384 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "common.hpp"
+#include "config.hpp"
+
+/*
+ * Layout of the named shared memory object (/dev/shm/<name>):
+ *
+ *   [ShmRingHeader][padding up to data_offset][data ring of capacity bytes]
+ *
+ * There is exactly one writer (the recorder) and any number of readers. The writer
+ * never waits for readers. Readers keep their own read position and detect by
+ * themselves if the writer has lapped them (data lost for that reader only).
+ * Cursors are absolute stream byte positions, the ring offset is position % capacity.
+ */
+constexpr uint32_t SHM_RING_MAGIC = 0x47525341; // "ASRG"
+constexpr uint32_t SHM_RING_VERSION = 1;
+constexpr size_t SHM_RING_DEFAULT_SIZE = 1 << 20;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shm ring requires lock free 64 bit atomics");
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shm ring requires lock free 32 bit atomics");
+
+struct ShmRingHeader{
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    int32_t format = SND_PCM_FORMAT_UNKNOWN;    // snd_pcm_format_t
+    uint32_t rate = 0;
+    uint32_t channels = 0;
+    uint32_t bytes_per_frame = 0;
+    uint64_t capacity = 0;                      // size of the data ring in bytes
+    uint64_t data_offset = 0;                   // start of the data ring from start of the object
+    // written by the writer only
+    alignas(64) std::atomic<uint64_t> write_pos{0};    // end of published data
+    std::atomic<uint64_t> reserve_pos{0};              // end of data currently being copied
+    std::atomic<uint32_t> futex_seq{0};                // bumped on every publish, readers wait on it
+    std::atomic<uint32_t> writer_alive{0};
+    // written by readers
+    alignas(64) std::atomic<uint32_t> waiters{0};
+};
+
+inline long shmRingFutex(std::atomic<uint32_t>* addr, int op, uint32_t val, const struct timespec* timeout = nullptr){
+    // not FUTEX_PRIVATE_FLAG: waiters and waker live in different processes
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, timeout, nullptr, 0);
+}
+
+class ShmRingWriter{
+public:
+    ShmRingWriter(){
+        TR_MSG("ShmRingWriter");
+    };
+    ~ShmRingWriter(){
+        close();
+    };
+
+    bool init(const std::string& name, size_t size, const HwConfig& streamInfo, int bytesPerSample){
+        TR();
+        LOG_AND_RETURN_IF(LOG_DEBUG, m_header != nullptr, true, "Already initialized");
+        MSG_AND_RETURN_IF(name.empty() || name[0] != '/', false, "Shm name must start with '/': %s", name.c_str());
+        MSG_AND_RETURN_IF(bytesPerSample <= 0, false, "Invalid bytes per sample %d", bytesPerSample);
+        // keep whole frames in the ring, so a frame is never split between end and start of the ring
+        size_t capacity = size - (size % bytesPerSample);
+        MSG_AND_RETURN_IF(capacity == 0, false, "Shm ring size %zu too small", size);
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        size_t dataOffset = ((sizeof(ShmRingHeader) + pageSize - 1) / pageSize) * pageSize;
+        size_t total = dataOffset + capacity;
+
+        // an object of the same name may still be mapped by another writer and its readers;
+        // truncating it would SIGBUS them, unlinking leaves them their (orphaned) mapping
+        (void)shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        MSG_AND_RETURN_IF(fd < 0, false, "shm_open %s failed: %s", name.c_str(), strerror(errno));
+        struct stat st;
+        if(fstat(fd, &st) < 0 || ftruncate(fd, total) < 0){
+            LOG_ERROR("ftruncate %s failed: %s", name.c_str(), strerror(errno));
+            (void)::close(fd);
+            (void)shm_unlink(name.c_str());
+            return false;
+        }
+        void* mem = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        (void)::close(fd);
+        if(mem == MAP_FAILED){
+            LOG_ERROR("mmap %s failed: %s", name.c_str(), strerror(errno));
+            (void)shm_unlink(name.c_str());
+            return false;
+        }
+        // fresh object from ftruncate is zero filled, placement new only sets up the atomics
+        m_header = new (mem) ShmRingHeader();
+        m_header->version = SHM_RING_VERSION;
+        m_header->format = streamInfo.format;
+        m_header->rate = streamInfo.rate;
+        m_header->channels = streamInfo.channels;
+        m_header->bytes_per_frame = bytesPerSample;
+        m_header->capacity = capacity;
+        m_header->data_offset = dataOffset;
+        m_header->writer_alive.store(1, std::memory_order_relaxed);
+        // magic last: readers refuse to attach before the header is complete
+        std::atomic_thread_fence(std::memory_order_release);
+        m_header->magic = SHM_RING_MAGIC;
+
+        m_data = static_cast<uint8_t*>(mem) + dataOffset;
+        m_mappedSize = total;
+        m_name = name;
+        m_dev = st.st_dev;
+        m_ino = st.st_ino;
+        LOG_INFO("Shm ring %s ready: %zu bytes", name.c_str(), capacity);
+        return true;
+    };
+
+    void write(const uint8_t* data, size_t size){
+        if(m_header == nullptr || size == 0){
+            return;
+        }
+        const uint64_t capacity = m_header->capacity;
+        uint64_t pos = m_header->write_pos.load(std::memory_order_relaxed);
+        // more than the ring can hold: only the newest bytes survive anyway
+        if(size > capacity){
+            pos += size - capacity;
+            data += size - capacity;
+            size = capacity;
+        }
+        // announce the region we are about to overwrite, readers validate against it
+        m_header->reserve_pos.store(pos + size, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        uint64_t offset = pos % capacity;
+        size_t first = std::min<uint64_t>(size, capacity - offset);
+        memcpy(m_data + offset, data, first);
+        if(first < size){
+            memcpy(m_data, data + first, size - first);
+        }
+
+        m_header->write_pos.store(pos + size, std::memory_order_release);
+        wakeReaders();
+    };
+
+    void close(){
+        if(m_header == nullptr){
+            return;
+        }
+        m_header->writer_alive.store(0, std::memory_order_release);
+        wakeReaders();
+        (void)munmap(m_header, m_mappedSize);
+        // attached readers keep their mapping, the name is free for the next recording.
+        // Unless a newer writer took it over already, that object is not ours to remove
+        int fd = shm_open(m_name.c_str(), O_RDONLY, 0);
+        if(fd >= 0){
+            struct stat st;
+            bool ours = fstat(fd, &st) == 0 && st.st_dev == m_dev && st.st_ino == m_ino;
+            (void)::close(fd);
+            if(ours){
+                (void)shm_unlink(m_name.c_str());
+            }
+        }
+        m_header = nullptr;
+        m_data = nullptr;
+    };
+
+private:
+    ShmRingHeader* m_header = nullptr;
+    uint8_t* m_data = nullptr;
+    size_t m_mappedSize = 0;
+    std::string m_name = "";
+    dev_t m_dev = 0;
+    ino_t m_ino = 0;
+
+    void wakeReaders(){
+        m_header->futex_seq.fetch_add(1, std::memory_order_seq_cst);
+        // skip the syscall when nobody sleeps, the common case for polling readers
+        if(m_header->waiters.load(std::memory_order_seq_cst) > 0){
+            shmRingFutex(&m_header->futex_seq, FUTEX_WAKE, INT_MAX);
+        }
+    };
+};
+
+/*
+ * A view into the ring. Data is not copied; it is split in two parts when it wraps
+ * around the end of the ring. Valid until release() is called.
+ */
+struct ShmRingSpan{
+    const uint8_t* data[2] = {nullptr, nullptr};
+    size_t size[2] = {0, 0};
+    uint64_t position = 0;  // stream byte position of data[0]
+
+    size_t total() const {
+        return size[0] + size[1];
+    };
+};
+
+class ShmRingReader{
+public:
+    ShmRingReader(){
+        TR_MSG("ShmRingReader");
+    };
+    ~ShmRingReader(){
+        detach();
+    };
+
+    // fromOldest: start with the oldest data still in the ring instead of live data
+    bool attach(const std::string& name, bool fromOldest = false){
+        TR();
+        LOG_AND_RETURN_IF(LOG_DEBUG, m_header != nullptr, true, "Already attached");
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        MSG_AND_RETURN_IF(fd < 0, false, "shm_open %s failed: %s", name.c_str(), strerror(errno));
+        struct stat st;
+        if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ShmRingHeader)){
+            (void)::close(fd);
+            LOG_ERROR("Shm object %s too small", name.c_str());
+            return false;
+        }
+        // waiters is the only field a reader writes
+        void* mem = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        (void)::close(fd);
+        MSG_AND_RETURN_IF(mem == MAP_FAILED, false, "mmap %s failed: %s", name.c_str(), strerror(errno));
+        ShmRingHeader* header = static_cast<ShmRingHeader*>(mem);
+        bool valid = header->magic == SHM_RING_MAGIC && header->version == SHM_RING_VERSION
+                  && header->data_offset + header->capacity <= (uint64_t)st.st_size;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(!valid){
+            (void)munmap(mem, st.st_size);
+            LOG_ERROR("Shm object %s is no ring or not ready", name.c_str());
+            return false;
+        }
+        m_header = header;
+        m_data = static_cast<const uint8_t*>(mem) + header->data_offset;
+        m_mappedSize = st.st_size;
+        uint64_t writePos = m_header->write_pos.load(std::memory_order_acquire);
+        m_readPos = writePos;
+        if(fromOldest){
+            m_readPos = writePos > m_header->capacity ? writePos - m_header->capacity : 0;
+        }
+        m_lostBytes = 0;
+        return true;
+    };
+
+    void detach(){
+        if(m_header == nullptr){
+            return;
+        }
+        (void)munmap(m_header, m_mappedSize);
+        m_header = nullptr;
+        m_data = nullptr;
+    };
+
+    const ShmRingHeader* info() const {
+        return m_header;
+    };
+
+    /*
+     * Get the next unread data. Blocks up to timeoutMs (-1 = forever, 0 = poll) if there is none.
+     * Returns false on timeout or if the writer is gone and everything was read.
+     */
+    bool acquire(ShmRingSpan& span, int timeoutMs = -1, size_t maxBytes = SIZE_MAX){
+        if(m_header == nullptr){
+            return false;
+        }
+        const uint64_t capacity = m_header->capacity;
+        while(true){
+            uint32_t seq = m_header->futex_seq.load(std::memory_order_acquire);
+            uint64_t writePos = m_header->write_pos.load(std::memory_order_acquire);
+            if(writePos > m_readPos){
+                if(writePos - m_readPos > capacity){
+                    // lapped by the writer, continue with the oldest data still there
+                    m_lostBytes += writePos - capacity - m_readPos;
+                    m_readPos = writePos - capacity;
+                }
+                size_t size = std::min<uint64_t>(writePos - m_readPos, maxBytes);
+                uint64_t offset = m_readPos % capacity;
+                size_t first = std::min<uint64_t>(size, capacity - offset);
+                span.data[0] = m_data + offset;
+                span.size[0] = first;
+                span.data[1] = first < size ? m_data : nullptr;
+                span.size[1] = size - first;
+                span.position = m_readPos;
+                return true;
+            }
+            if(m_header->writer_alive.load(std::memory_order_acquire) == 0 || timeoutMs == 0){
+                return false;
+            }
+            if(!waitFor(seq, timeoutMs)){
+                return false;
+            }
+        }
+    };
+
+    /*
+     * Mark the span as consumed. Returns false if the writer overwrote (parts of) the span
+     * while it was in use, the consumed data must be discarded in that case.
+     */
+    bool release(const ShmRingSpan& span){
+        if(m_header == nullptr){
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t reservePos = m_header->reserve_pos.load(std::memory_order_relaxed);
+        bool valid = reservePos <= span.position + m_header->capacity;
+        m_readPos = span.position + span.total();
+        if(!valid){
+            m_lostBytes += span.total();
+        }
+        return valid;
+    };
+
+    // convenience: copy up to size bytes into buff, returns number of bytes copied
+    size_t read(uint8_t* buff, size_t size, int timeoutMs = -1){
+        ShmRingSpan span;
+        if(!acquire(span, timeoutMs, size)){
+            return 0;
+        }
+        memcpy(buff, span.data[0], span.size[0]);
+        if(span.size[1] > 0){
+            memcpy(buff + span.size[0], span.data[1], span.size[1]);
+        }
+        return release(span) ? span.total() : 0;
+    };
+
+    uint64_t getLostBytes() const {
+        return m_lostBytes;
+    };
+
+private:
+    ShmRingHeader* m_header = nullptr;
+    const uint8_t* m_data = nullptr;
+    size_t m_mappedSize = 0;
+    uint64_t m_readPos = 0;
+    uint64_t m_lostBytes = 0;
+
+    bool waitFor(uint32_t seq, int timeoutMs){
+        struct timespec ts;
+        struct timespec* timeout = nullptr;
+        if(timeoutMs > 0){
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (long)(timeoutMs % 1000) * 1000000L;
+            timeout = &ts;
+        }
+        m_header->waiters.fetch_add(1, std::memory_order_seq_cst);
+        // returns immediately with EAGAIN if the writer published in between
+        long res = shmRingFutex(&m_header->futex_seq, FUTEX_WAIT, seq, timeout);
+        int err = errno;
+        m_header->waiters.fetch_sub(1, std::memory_order_acq_rel);
+        return !(res < 0 && err == ETIMEDOUT);
+    };
+};
+
+#endif
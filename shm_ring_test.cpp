@@ -0,0 +1,218 @@
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "config.hpp"
+#include "shm_ring.hpp"
+
+// Several readers, on threads and in a forked process, against one ShmRingWriter. Returns non zero on failure.
+
+constexpr int TEST_BYTES_PER_FRAME = 4;
+constexpr size_t TEST_PERIOD_FRAMES = 256;
+const std::string TEST_SHM_NAME = "/arecord_shm_ring_test";
+
+struct ReaderResult{
+    uint64_t got = 0;
+    uint64_t lost = 0;
+    uint64_t corrupt = 0;
+};
+
+// frame n of the stream holds n, so every byte can be checked against its stream position
+static void fillPeriod(std::vector<uint32_t>& period, uint64_t firstFrame){
+    for(size_t i = 0; i < period.size(); i++){
+        period[i] = (uint32_t)(firstFrame + i);
+    }
+}
+
+static void writePeriods(ShmRingWriter& writer, size_t first, size_t count){
+    std::vector<uint32_t> period(TEST_PERIOD_FRAMES);
+    for(size_t p = first; p < first + count; p++){
+        fillPeriod(period, p * TEST_PERIOD_FRAMES);
+        writer.write(reinterpret_cast<const uint8_t*>(period.data()), period.size() * TEST_BYTES_PER_FRAME);
+        if(p % 16 == 0){
+            std::this_thread::yield();
+        }
+    }
+}
+
+static uint64_t checkSpan(const ShmRingSpan& span){
+    uint64_t corrupt = 0;
+    uint64_t pos = span.position;
+    for(int part = 0; part < 2; part++){
+        for(size_t i = 0; i + TEST_BYTES_PER_FRAME <= span.size[part]; i += TEST_BYTES_PER_FRAME, pos += TEST_BYTES_PER_FRAME){
+            uint32_t value;
+            memcpy(&value, span.data[part] + i, sizeof(value));
+            corrupt += value != (uint32_t)(pos / TEST_BYTES_PER_FRAME) ? 1 : 0;
+        }
+    }
+    return corrupt;
+}
+
+// hold: if set, the first span is held until it turns true, so the reader gets lapped
+static void readAll(ShmRingReader& reader, unsigned int delayUs, const std::atomic<bool>* hold, ReaderResult& result){
+    ShmRingSpan span;
+    bool first = true;
+    while(reader.acquire(span, 1000)){
+        // a span overwritten while it was checked does not count, see release()
+        uint64_t corrupt = checkSpan(span);
+        while(first && hold && !hold->load()){
+            usleep(1000);
+        }
+        first = false;
+        if(reader.release(span)){
+            result.got += span.total();
+            result.corrupt += corrupt;
+        }
+        if(delayUs > 0){
+            usleep(delayUs);
+        }
+    }
+    result.lost = reader.getLostBytes();
+}
+
+// reader in a child process, the result comes back through a pipe
+static pid_t forkReader(int& resultFd){
+    int ready[2];
+    int result[2];
+    if(pipe(ready) < 0 || pipe(result) < 0){
+        return -1;
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        (void)close(ready[0]);
+        (void)close(result[0]);
+        ReaderResult r;
+        ShmRingReader reader;
+        char ok = reader.attach(TEST_SHM_NAME) ? 1 : 0;
+        if(write(ready[1], &ok, 1) == 1 && ok){
+            readAll(reader, 0, nullptr, r);
+            (void)!write(result[1], &r, sizeof(r));
+        }
+        _exit(0);
+    }
+    (void)close(ready[1]);
+    (void)close(result[1]);
+    char ok = 0;
+    bool attached = pid > 0 && read(ready[0], &ok, 1) == 1 && ok;
+    (void)close(ready[0]);
+    if(!attached){
+        (void)close(result[0]);
+        return -1;
+    }
+    resultFd = result[0];
+    return pid;
+}
+
+static bool collectForked(pid_t pid, int fd, ReaderResult& r){
+    bool ok = read(fd, &r, sizeof(r)) == sizeof(r);
+    (void)close(fd);
+    int status = 0;
+    ok &= waitpid(pid, &status, 0) == pid && WIFEXITED(status);
+    return ok;
+}
+
+/*
+ * readers: number of reader threads, the odd ones are slow: they hold their first span
+ * until everything is written, so they are lapped for sure. One more reader runs in a
+ * forked process. lossless: the ring holds all data and nobody is slow.
+ */
+static bool runTest(const std::string& name, unsigned int readers, size_t ringSize, size_t periods, bool lossless){
+    HwConfig config{};
+    config.channels = 2;
+    config.format = SND_PCM_FORMAT_S16_LE;
+    ShmRingWriter writer;
+    if(!writer.init(TEST_SHM_NAME, ringSize, config, TEST_BYTES_PER_FRAME)){
+        fprintf(stderr, "%s: writer init failed\n", name.c_str());
+        return false;
+    }
+    // fork before any reader thread exists
+    int forkedFd = -1;
+    pid_t forked = forkReader(forkedFd);
+    if(forked < 0){
+        fprintf(stderr, "%s: forked reader failed\n", name.c_str());
+        return false;
+    }
+    std::vector<ShmRingReader> rings(readers);
+    for(auto& ring : rings){
+        if(!ring.attach(TEST_SHM_NAME)){
+            fprintf(stderr, "%s: attach failed\n", name.c_str());
+            return false;
+        }
+    }
+    std::atomic<bool> written{false};
+    std::vector<ReaderResult> results(readers + 1);
+    std::vector<std::thread> threads;
+    for(unsigned int i = 0; i < readers; i++){
+        bool slow = !lossless && (i % 2);
+        threads.emplace_back(readAll, std::ref(rings[i]), slow ? 200 : 0, slow ? &written : nullptr, std::ref(results[i]));
+    }
+
+    writePeriods(writer, 0, periods);
+    written = true;
+    const uint64_t total = (uint64_t)periods * TEST_PERIOD_FRAMES * TEST_BYTES_PER_FRAME;
+    writer.close();
+    for(auto& thread : threads){
+        thread.join();
+    }
+    bool ok = collectForked(forked, forkedFd, results[readers]);
+    if(!ok){
+        fprintf(stderr, "%s: no result from the forked reader\n", name.c_str());
+    }
+
+    for(unsigned int i = 0; i <= readers; i++){
+        const ReaderResult& r = results[i];
+        bool slow = !lossless && i < readers && (i % 2);
+        bool readerOk = r.got + r.lost == total && r.corrupt == 0 && (!lossless || r.lost == 0) && (!slow || r.lost > 0);
+        printf("%s %s %u%s: written %lu got %lu lost %lu corrupt frames %lu %s\n", name.c_str(),
+               i < readers ? "reader" : "forked reader", i, slow ? " (slow)" : "",
+               (unsigned long)total, (unsigned long)r.got, (unsigned long)r.lost, (unsigned long)r.corrupt,
+               readerOk ? "ok" : "FAILED");
+        ok &= readerOk;
+    }
+    return ok;
+}
+
+// a span held while the writer goes around the ring is reported as overwritten and lost
+static bool runHeldSpanTest(){
+    HwConfig config{};
+    config.channels = 2;
+    config.format = SND_PCM_FORMAT_S16_LE;
+    const size_t ringSize = 16 * TEST_PERIOD_FRAMES * TEST_BYTES_PER_FRAME;
+    ShmRingWriter writer;
+    ShmRingReader reader;
+    if(!writer.init(TEST_SHM_NAME, ringSize, config, TEST_BYTES_PER_FRAME) || !reader.attach(TEST_SHM_NAME)){
+        fprintf(stderr, "shm_ring_held_span: init failed\n");
+        return false;
+    }
+    writePeriods(writer, 0, 1);
+    ShmRingSpan span;
+    bool ok = reader.acquire(span, 0);
+    // more than the capacity while the span is held
+    writePeriods(writer, 1, 20);
+    bool released = reader.release(span);
+    uint64_t lostAfterRelease = reader.getLostBytes();
+    ok &= !released && lostAfterRelease == span.total();
+    // the reader is behind by more than the ring: the next acquire skips to the oldest data
+    ShmRingSpan next;
+    ok &= reader.acquire(next, 0) && next.position == 21 * TEST_PERIOD_FRAMES * TEST_BYTES_PER_FRAME - ringSize
+          && checkSpan(next) == 0 && reader.getLostBytes() > lostAfterRelease;
+    printf("shm_ring_held_span: release %s, lost %lu after release, %lu after next acquire %s\n",
+           released ? "true" : "false", (unsigned long)lostAfterRelease, (unsigned long)reader.getLostBytes(),
+           ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(){
+    bool ok = true;
+    ok &= runHeldSpanTest();
+    // small ring, slow readers get lapped
+    ok &= runTest("shm_ring_lapped", 4, 64 * 1024, 4096, false);
+    // every byte fits into the ring, every reader must get all of it unchanged
+    ok &= runTest("shm_ring_lossless", 4, 1024 * 1024, 256, true);
+    printf("%s\n", ok ? "PASSED" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -51,13 +51,18 @@ public:
     };
 
     ~HwParams(){
-        // TODO
+        if(m_param){
+            snd_pcm_hw_params_free(m_param);
+        }
     };
 
+    // may be called again (after snd_pcm_drop) to renegotiate period and buffer size
     bool init(snd_pcm_t *handle, HwConfig& config){
         TR();
-        //snd_pcm_hw_params_t *params;
-        snd_pcm_hw_params_alloca(&m_param);
+        // heap, not alloca: the getters below use m_param after init returned
+        if(m_param == nullptr){
+            MSG_AND_RETURN_IF(snd_pcm_hw_params_malloc(&m_param) < 0, false, "Could not allocate hw params");
+        }
         MSG_AND_RETURN_IF(handle == nullptr, false, "Handle is null");
         MSG_AND_RETURN_IF(snd_pcm_hw_params_any(handle, m_param) < 0, false, "Configuration for PCM broken.");
         MSG_AND_RETURN_IF(snd_pcm_hw_params_set_access(handle, m_param, config.access_mode) < 0, false, "Fail to set access mode %d", config.access_mode);
@@ -68,21 +73,27 @@ public:
             snd_pcm_uframes_t val = (snd_pcm_uframes_t)config.size_near;
             MSG_AND_RETURN_IF(snd_pcm_hw_params_set_period_size_near(handle, m_param, &val, 0) < 0, false, "Fail to set size near %zu", val);
         }
+        if(config.buffer_size_near > 0) {
+            snd_pcm_uframes_t val = (snd_pcm_uframes_t)config.buffer_size_near;
+            MSG_AND_RETURN_IF(snd_pcm_hw_params_set_buffer_size_near(handle, m_param, &val) < 0, false, "Fail to set buffer size near %zu", val);
+        }
         MSG_AND_RETURN_IF(snd_pcm_hw_params(handle, m_param) < 0, false, "Could not set HW Params");
         m_config = config;
         MSG_AND_RETURN_IF(snd_pcm_hw_params_get_period_size(m_param, &m_periodSizeInSamples, 0) < 0, false, "could not get period size near.");
+        MSG_AND_RETURN_IF(snd_pcm_hw_params_get_buffer_size(m_param, &m_bufferSizeInSamples) < 0, false, "could not get buffer size.");
+        TR_MSG("Period %zu frames, buffer %zu frames", m_periodSizeInSamples, m_bufferSizeInSamples);
         return true;
     };
 
     int getPeriodSizeInBytes(){
         int samples = getPeriodSizeInSamples();
         if(samples < 0){
-            TR_MSG("get samples failed");
+            LOG_ERROR("get samples failed");
             return -1;
         }
         int bytesPerSample = getBytesPerSample();
         if(bytesPerSample < 0){
-            TR_MSG("get bytes per sample failed");
+            LOG_ERROR("get bytes per sample failed");
             return -1;
         }
         unsigned int val = samples * bytesPerSample;
@@ -104,6 +115,10 @@ public:
         return m_periodSizeInSamples;
     }
 
+    int getBufferSizeInSamples(){
+        return m_bufferSizeInSamples > INT_MAX ? -1 : (int)m_bufferSizeInSamples;
+    }
+
     int getBytesPerSample(){
         snd_pcm_format_t format = m_config.format;
         /*
@@ -116,7 +131,7 @@ public:
         */
         auto it = format2bytes.find(format);
         if(it == format2bytes.end()){
-            TR_MSG("could not find formate %d", format);
+            LOG_ERROR("could not find formate %d", format);
             return -1;
         }
         uint8_t bytesPerSample = it->second;
@@ -139,7 +154,7 @@ public:
         unsigned int val;
         int res = snd_pcm_hw_params_get_period_time(m_param, &val, 0);
         if(res < 0){
-            TR_MSG("get period time failed");
+            LOG_ERROR("get period time failed");
             return -1;
         }
         TR_MSG("Period Time: %u us", val);
@@ -147,41 +162,67 @@ public:
     }
 
 private:
-    snd_pcm_hw_params_t *m_param;
-    snd_pcm_uframes_t m_periodSizeInSamples;
+    snd_pcm_hw_params_t *m_param = nullptr;
+    snd_pcm_uframes_t m_periodSizeInSamples = 0;
+    snd_pcm_uframes_t m_bufferSizeInSamples = 0;
     HwConfig m_config;
 };
-#endif
 
-/*
 class SwParams{
 public:
     SwParams(){
         TR_MSG("Swparams");
     };
     ~SwParams(){
-        // todo
+        if(m_param){
+            snd_pcm_sw_params_free(m_param);
+        }
     };
 
-    bool init(snd_pcm_t *handle, HwConfig& config){
+    /*
+     * Call after HwParams::init, installing hw params resets the sw params.
+     * Unset (-1) values of the config are filled with the defaults used:
+     * avail_min = period, start_threshold = 1 for capture / buffer for playback, stop_threshold = buffer.
+     */
+    bool init(snd_pcm_t *handle, HwConfig& config, snd_pcm_uframes_t periodSize, snd_pcm_uframes_t bufferSize){
         TR();
-        snd_pcm_sw_params_t *param;
-        snd_pcm_sw_params_alloca(&param);
         MSG_AND_RETURN_IF(handle == nullptr, false, "Handle is null");
-        MSG_AND_RETURN_IF(snd_pcm_sw_params_current(handle, param) < 0, false, "Sw Configuration for PCM broken.");
-        // not sure if next line is okay. TODO check/test
-        config.avail_min = config.chunk_size;
-        MSG_AND_RETURN_IF(snd_pcm_sw_params_set_avail_min(handle, param, config.avail_min) < 0, false, "Can not set avail min: %u", config.avail_min);
-        config.start_threshold = config.start_threshold == 0 ? config.buffer_size : config.start_threshold;
-        MSG_AND_RETURN_IF(snd_pcm_sw_params_set_start_threshold(handle, param, config.start_threshold) < 0, false, "Can not set start threshold: %zu.", config.start_threshold);
-        config.stop_threshold = config.stop_threshold == 0 ? config.buffer_size : config.stop_threshold;
-        MSG_AND_RETURN_IF(snd_pcm_sw_params_set_stop_threshold(handle, param, config.stop_threshold) < 0, false, "Can not set stop threshold: %zu.", config.stop_threshold);
-        MSG_AND_RETURN_IF(snd_pcm_sw_params(handle, param) < 0, false, "Sw Configuration for PCM could not be installed.");
-        m_param = param;
+        if(m_param == nullptr){
+            MSG_AND_RETURN_IF(snd_pcm_sw_params_malloc(&m_param) < 0, false, "Could not allocate sw params");
+        }
+        // current, not default: keep what others (e.g. timestamps) configured
+        MSG_AND_RETURN_IF(snd_pcm_sw_params_current(handle, m_param) < 0, false, "Sw Configuration for PCM broken.");
+        snd_pcm_uframes_t availMin = config.avail_min > 0 ? config.avail_min : periodSize;
+        MSG_AND_RETURN_IF(snd_pcm_sw_params_set_avail_min(handle, m_param, availMin) < 0, false, "Can not set avail min: %zu", availMin);
+        snd_pcm_uframes_t startThreshold = config.start_threshold > 0 ? config.start_threshold
+                                         : config.stream == SND_PCM_STREAM_CAPTURE ? 1 : bufferSize;
+        MSG_AND_RETURN_IF(snd_pcm_sw_params_set_start_threshold(handle, m_param, startThreshold) < 0, false, "Can not set start threshold: %zu.", startThreshold);
+        snd_pcm_uframes_t stopThreshold = config.stop_threshold > 0 ? config.stop_threshold : bufferSize;
+        MSG_AND_RETURN_IF(snd_pcm_sw_params_set_stop_threshold(handle, m_param, stopThreshold) < 0, false, "Can not set stop threshold: %zu.", stopThreshold);
+        MSG_AND_RETURN_IF(snd_pcm_sw_params(handle, m_param) < 0, false, "Sw Configuration for PCM could not be installed.");
+        m_availMin = availMin;
+        m_startThreshold = startThreshold;
+        m_stopThreshold = stopThreshold;
         return true;
     };
 
+    snd_pcm_uframes_t getAvailMin(){
+        return m_availMin;
+    }
+
+    snd_pcm_uframes_t getStartThreshold(){
+        return m_startThreshold;
+    }
+
+    snd_pcm_uframes_t getStopThreshold(){
+        return m_stopThreshold;
+    }
+
 private:
-    snd_pcm_sw_params_t *m_param;
+    snd_pcm_sw_params_t *m_param = nullptr;
+    snd_pcm_uframes_t m_availMin = 0;
+    snd_pcm_uframes_t m_startThreshold = 0;
+    snd_pcm_uframes_t m_stopThreshold = 0;
 };
-*/
\ No newline at end of file
+
+#endif
@@ -0,0 +1,43 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "capture_handle.hpp"
+
+// Repairs the header sizes of wav files left behind by an interrupted recording.
+int main(int argc, char** argv){
+    bool dryRun = false;
+    bool truncate = false;
+    int files = 0;
+    int failed = 0;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-n") == 0){
+            dryRun = true;
+            continue;
+        }
+        if(strcmp(argv[i], "-t") == 0){
+            truncate = true;
+            continue;
+        }
+        files++;
+        WavRepair repair;
+        if(!repairWavHeader(argv[i], dryRun, truncate, repair)){
+            fprintf(stderr, "%s: could not repair\n", argv[i]);
+            failed++;
+            continue;
+        }
+        bool changed = repair.oldRiffSize != repair.riffSize || repair.oldDataSize != repair.dataSize;
+        printf("%s: data %u -> %u bytes, riff %u -> %u%s%s\n", argv[i], repair.oldDataSize, repair.dataSize,
+               repair.oldRiffSize, repair.riffSize, changed ? "" : " (unchanged)", dryRun ? " [dry run]" : "");
+        if(repair.partialFrameBytes > 0){
+            printf("%s: %llu trailing bytes are no whole frame, -t cuts them off\n", argv[i], (unsigned long long)repair.partialFrameBytes);
+        }
+    }
+    if(files == 0){
+        fprintf(stderr, "usage: %s [-n] [-t] file.wav...\n"
+                        "  -n  only show what would change\n"
+                        "  -t  truncate a partial last frame\n", argv[0]);
+        return 2;
+    }
+    return failed > 0 ? 1 : 0;
+}
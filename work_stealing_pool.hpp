@@ -0,0 +1,195 @@
+/*
+MIT License
+
+Copyright (c) 2024 Alexander Wentz
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef _WORK_STEALING_POOL_H_
+#define _WORK_STEALING_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "common.hpp"
+
+/*
+ * Fixed set of workers, each with its own task deque. A worker takes its newest task
+ * (cache warm, tasks spawned by a task run next), idle workers steal the oldest task of
+ * another worker (usually the biggest remaining piece of work). Tasks may submit tasks.
+ */
+class WorkStealingPool{
+public:
+    using Task = std::function<void()>;
+
+    WorkStealingPool(){
+        TR_MSG("WorkStealingPool");
+    };
+    ~WorkStealingPool(){
+        stop();
+    };
+
+    bool init(unsigned int threads){
+        TR();
+        LOG_AND_RETURN_IF(LOG_DEBUG, !m_workers.empty(), true, "Already initialized");
+        if(threads == 0){
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        m_running = true;
+        for(unsigned int i = 0; i < threads; i++){
+            m_workers.emplace_back(new Worker());
+        }
+        for(unsigned int i = 0; i < threads; i++){
+            m_workers[i]->thread = std::thread(&WorkStealingPool::run, this, i);
+        }
+        return true;
+    };
+
+    unsigned int size() const {
+        return m_workers.size();
+    };
+
+    // from a worker: onto its own deque, from outside: spread round robin
+    void submit(Task task){
+        m_outstanding.fetch_add(1, std::memory_order_relaxed);
+        size_t target = t_worker >= 0 && t_pool == this ? t_worker : m_next.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+        {
+            std::lock_guard<std::mutex> lock(m_workers[target]->mutex);
+            m_workers[target]->tasks.push_back(std::move(task));
+        }
+        {
+            // under the idle mutex, so a worker about to sleep sees it or gets the notify
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            m_queued.fetch_add(1, std::memory_order_relaxed);
+        }
+        m_idleCond.notify_one();
+    };
+
+    // until every submitted task (and the tasks they submitted) has run
+    void wait(){
+        std::unique_lock<std::mutex> lock(m_idleMutex);
+        m_doneCond.wait(lock, [this]{ return m_outstanding.load() == 0; });
+    };
+
+    void stop(){
+        {
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            m_running = false;
+        }
+        m_idleCond.notify_all();
+        for(auto& worker : m_workers){
+            if(worker->thread.joinable()){
+                worker->thread.join();
+            }
+        }
+        m_workers.clear();
+    };
+
+    uint64_t getExecuted() const {
+        return m_executed.load();
+    };
+
+    uint64_t getStolen() const {
+        return m_stolen.load();
+    };
+
+private:
+    struct Worker{
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<uint64_t> m_outstanding{0};
+    // tasks sitting in the deques, idle workers sleep while it is <= 0. Signed: a task
+    // may be taken before submit() counted it
+    std::atomic<int64_t> m_queued{0};
+    std::atomic<uint64_t> m_next{0};
+    std::atomic<uint64_t> m_executed{0};
+    std::atomic<uint64_t> m_stolen{0};
+    bool m_running = false;
+    std::mutex m_idleMutex;
+    std::condition_variable m_idleCond;
+    std::condition_variable m_doneCond;
+
+    static inline thread_local int t_worker = -1;
+    static inline thread_local WorkStealingPool* t_pool = nullptr;
+
+    bool popOwn(size_t index, Task& task){
+        Worker& worker = *m_workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if(worker.tasks.empty()){
+            return false;
+        }
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        return true;
+    };
+
+    bool steal(size_t thief, Task& task){
+        const size_t count = m_workers.size();
+        for(size_t i = 1; i < count; i++){
+            Worker& victim = *m_workers[(thief + i) % count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if(!victim.tasks.empty()){
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                m_stolen.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    };
+
+    void run(size_t index){
+        t_worker = index;
+        t_pool = this;
+        while(true){
+            Task task;
+            if(popOwn(index, task) || steal(index, task)){
+                m_queued.fetch_sub(1, std::memory_order_relaxed);
+                task();
+                m_executed.fetch_add(1, std::memory_order_relaxed);
+                if(m_outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1){
+                    std::lock_guard<std::mutex> lock(m_idleMutex);
+                    m_doneCond.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_idleMutex);
+            m_idleCond.wait(lock, [this]{ return !m_running || m_queued.load(std::memory_order_relaxed) > 0; });
+            if(!m_running){
+                break;
+            }
+        }
+        t_worker = -1;
+        t_pool = nullptr;
+    };
+};
+
+#endif